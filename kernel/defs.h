@@ -2,12 +2,15 @@ struct buf;
 struct context;
 struct file;
 struct inode;
+struct iovec;
 struct pipe;
 struct proc;
 struct spinlock;
 struct sleeplock;
 struct stat;
 struct superblock;
+struct tgroup;
+struct vma;
 
 // bio.c
 void            binit(void);
@@ -33,9 +36,19 @@ void            fileinit(void);
 int             fileread(struct file*, uint64, int n);
 int             filestat(struct file*, uint64 addr);
 int             filewrite(struct file*, uint64, int n);
+int             filereadat(struct file*, uint64, int, uint);
+int             filewriteat(struct file*, uint64, int, uint);
+int             fileseek(struct file*, int, int);
+int             filereadv(struct file*, struct iovec*, int);
+int             filewritev(struct file*, struct iovec*, int);
+int             filesync(struct file*, int);
 void            fflush();
-void            launch_commit_worker();
 int            filetruncate(struct file*, int n);
+int             filesplice(struct file*, struct file*, int, int);
+
+// futex.c
+void            futexinit(void);
+int             futex(uint64, int, int);
 
 // fs.c
 void            fsinit(int);
@@ -47,6 +60,8 @@ void            iinit();
 void            ilock(struct inode*);
 void            iput(struct inode*);
 void            iunlock(struct inode*);
+void            ilockshared(struct inode*);
+void            iunlockshared(struct inode*);
 void            iunlockput(struct inode*);
 void            iupdate(struct inode*);
 int             namecmp(const char*, const char*);
@@ -67,18 +82,37 @@ void            ramdiskrw(struct buf*);
 void* kalloc(void);
 void            kfree(void*);
 void            kinit(void);
+void            kdup(void*);
+int             krefs(void*);
+void*           megaalloc(void);
+void            megafree(void*);
+void            megabreak(void*);
 
 // log.c
 void            initlog(int, struct superblock*);
 void            log_write(struct buf*);
 void            begin_op(void);
 void            end_op(void);
+void            commitinit(void);
+uint            logtxid(void);
+void            logsync(uint);
+int             logstats(uint64);
+
+// pcache.c
+void            pcinit(void);
+uint64          pcget(struct inode*, uint);
+void            pcinval(struct inode*);
+void            pcwrite(struct inode*, uint, char*, uint);
+int             pcread(struct inode*, int, uint64, uint, uint);
 
 // pipe.c
 int             pipealloc(struct file**, struct file**);
 void            pipeclose(struct pipe*, int);
 int             piperead(struct pipe*, uint64, int);
 int             pipewrite(struct pipe*, uint64, int);
+int             pipefromi(struct pipe*, struct inode*, uint*, int);
+int             pipetoi(struct pipe*, struct inode*, uint*, int);
+int             pipetopipe(struct pipe*, struct pipe*, int, int);
 
 // printf.c
 void            printf(char*, ...);
@@ -94,8 +128,8 @@ void            printfinit(void);
 int             cpuid(void);
 void            exit(int);
 int             fork(void);
-int             growproc(int);
-void            proc_mapstacks(pagetable_t);
+int             clone(uint64, uint64, uint64);
+uint64          growproc(int);
 pagetable_t     proc_pagetable(struct proc*);
 void            proc_freepagetable(pagetable_t, uint64);
 int             kill(int);
@@ -107,14 +141,29 @@ struct proc* myproc();
 void            procinit(void);
 void            scheduler(void) __attribute__((noreturn));
 void            sched(void);
+void            setrunnable(struct proc*);
+int             setpriority(int, int, int);
+int             setaffinity(int, uint64);
+int             setquantum(int);
+void            timerarm(void);
+void            timerexpire(void);
+int             needresched(void);
 void            sleep(void*, struct spinlock*);
+int             sleepuntil(void*, struct spinlock*, uint64);
 void            userinit(void);
-int             wait(uint64);
+int             wait(int, uint64);
 void            wakeup(void*);
+int             wakeupn(void*, int);
 void            yield(void);
 int             either_copyout(int user_dst, uint64 dst, void* src, uint64 len);
 int             either_copyin(void* dst, int user_src, uint64 src, uint64 len);
 void            procdump(void);
+struct proc*    kthread_create(char*, void (*)(void*), void*);
+void            kthread_exit(int);
+int             kthread_join(struct proc*);
+void            tgpause(struct tgroup*);
+void            tgresume(struct tgroup*);
+struct inode*   cwdget(void);
 
 // swtch.S
 void            swtch(struct context*, struct context*);
@@ -124,15 +173,28 @@ void            acquire(struct spinlock*);
 int             holding(struct spinlock*);
 void            initlock(struct spinlock*, char*);
 void            release(struct spinlock*);
+void            lockdump(void);
+int             lockclassof(char*, int);
+void            lockacquired(int, uint64, uint64);
+void            lockreleased(int, uint64);
+int             lockstats(uint64, int);
 void            push_off(void);
 void            pop_off(void);
 
 // sleeplock.c
 void            acquiresleep(struct sleeplock*);
 void            releasesleep(struct sleeplock*);
+void            acquiresleepshared(struct sleeplock*);
+void            releasesleepshared(struct sleeplock*);
 int             holdingsleep(struct sleeplock*);
+int             holdingsleepshared(struct sleeplock*);
 void            initsleeplock(struct sleeplock*, char*);
 
+// start.c
+int             clockticked(void);
+void            ipi(int);
+void            settimer(uint64);
+
 // string.c
 int             memcmp(const void*, const void*, uint);
 void* memmove(void*, const void*, uint);
@@ -151,7 +213,6 @@ int             fetchaddr(uint64, uint64*);
 void            syscall();
 
 // trap.c
-extern uint     ticks;
 void            trapinit(void);
 void            trapinithart(void);
 extern struct spinlock tickslock;
@@ -168,7 +229,9 @@ int             uartgetc(void);
 void            kvminit(void);
 void            kvminithart(void);
 void            kvmmap(pagetable_t, uint64, uint64, uint64, int);
+int             kvmmapstack(uint64, uint64);
 int             mappages(pagetable_t, uint64, uint64, uint64, int);
+int             mapmega(pagetable_t, uint64, uint64, int);
 pagetable_t     uvmcreate(void);
 void            uvmfirst(pagetable_t, uchar*, uint);
 uint64          uvmalloc(pagetable_t, uint64, uint64, int);
@@ -176,12 +239,26 @@ uint64          uvmdealloc(pagetable_t, uint64, uint64);
 int             uvmcopy(pagetable_t, pagetable_t, uint64);
 void            uvmfree(pagetable_t, uint64);
 void            uvmunmap(pagetable_t, uint64, uint64, int);
+void            uvmunmapshared(pagetable_t, uint64, uint64, struct spinlock*);
 void            uvmclear(pagetable_t, uint64);
 pte_t* walk(pagetable_t, uint64, int);
 uint64          walkaddr(pagetable_t, uint64);
+int             setcopymode(int);
 int             copyout(pagetable_t, uint64, char*, uint64);
 int             copyin(pagetable_t, char*, uint64, uint64);
 int             copyinstr(pagetable_t, char*, uint64, uint64);
+uint64          vmfault(pagetable_t, uint64, int);
+
+// vma.c
+struct vma*     vmalookup(struct vma*, uint64);
+struct vma*     mmapoverlap(struct vma*, uint64, uint64);
+uint64          vmapage(struct vma*, uint64, int, int*);
+void            vmaprefault(uint64, uint64);
+int             vmacopy(pagetable_t, pagetable_t, struct vma*, struct vma*);
+void            mmapclose(pagetable_t, struct vma*);
+uint64          mmap(uint64, int, int, int, struct file*, int);
+int             munmap(uint64, int);
+void            vmafree(struct vma*);
 
 // plic.c
 void            plicinit(void);
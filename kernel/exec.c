@@ -7,8 +7,6 @@
 #include "defs.h"
 #include "elf.h"
 
-static int loadseg(pde_t *, uint64, struct inode *, uint, uint);
-
 int flags2perm(int flags)
 {
     int perm = 0;
@@ -23,21 +21,32 @@ int
 exec(char *path, char **argv)
 {
   char *s, *last;
-  int i, off;
+  int i, off, nvma, locked;
   uint64 argc, sz = 0, sp, ustack[MAXARG], stackbase;
   struct elfhdr elf;
   struct inode *ip;
   struct proghdr ph;
+  struct vma *vma = 0;
   pagetable_t pagetable = 0, oldpagetable;
   struct proc *p = myproc();
 
+  // other threads would lose the memory they run in;
+  // they must all have exited and been waited for.
+  acquire(&p->tg->lock);
+  if(p->tg->ref > 1){
+    release(&p->tg->lock);
+    return -1;
+  }
+  release(&p->tg->lock);
+
   begin_op();
 
   if((ip = namei(path)) == 0){
     end_op();
     return -1;
   }
-  ilock(ip);
+  ilockshared(ip);
+  locked = 1;
 
   // Check ELF header
   if(readi(ip, 0, (uint64)&elf, 0, sizeof(elf)) != sizeof(elf))
@@ -49,7 +58,12 @@ exec(char *path, char **argv)
   if((pagetable = proc_pagetable(p)) == 0)
     goto bad;
 
-  // Load program into memory.
+  // Record the program's segments. Nothing is read yet;
+  // vmfault() pages them in from ip on first touch.
+  if((vma = (struct vma*)kalloc()) == 0)
+    goto bad;
+  memset(vma, 0, NVMA*sizeof(struct vma));
+  nvma = 0;
   for(i=0, off=elf.phoff; i<elf.phnum; i++, off+=sizeof(ph)){
     if(readi(ip, 0, (uint64)&ph, off, sizeof(ph)) != sizeof(ph))
       goto bad;
@@ -61,19 +75,28 @@ exec(char *path, char **argv)
       goto bad;
     if(ph.vaddr % PGSIZE != 0)
       goto bad;
-    uint64 sz1;
-    if((sz1 = uvmalloc(pagetable, sz, ph.vaddr + ph.memsz, flags2perm(ph.flags))) == 0)
+    if(ph.vaddr < sz || ph.vaddr + ph.memsz >= USERTOP)
+      goto bad;
+    if(ph.off + ph.filesz < ph.off)
       goto bad;
-    sz = sz1;
-    if(loadseg(pagetable, ph.vaddr, ip, ph.off, ph.filesz) < 0)
+    if(nvma >= NVMA)
       goto bad;
+    vma[nvma].start = ph.vaddr;
+    vma[nvma].end = PGROUNDUP(ph.vaddr + ph.memsz);
+    vma[nvma].perm = flags2perm(ph.flags) | PTE_R;
+    vma[nvma].ip = ip;
+    vma[nvma].off = ph.off;
+    vma[nvma].filesz = ph.filesz;
+    nvma++;
+    sz = ph.vaddr + ph.memsz;
   }
-  iunlockput(ip);
+  // keep our reference to ip for the segments until the commit.
+  iunlockshared(ip);
   end_op();
-  ip = 0;
+  locked = 0;
 
   p = myproc();
-  uint64 oldsz = p->sz;
+  uint64 oldsz = p->tg->sz;
 
   // Allocate two pages at the next page boundary.
   // Make the first inaccessible as a stack guard.
@@ -123,44 +146,37 @@ exec(char *path, char **argv)
   // Commit to the user image.
   oldpagetable = p->pagetable;
   p->pagetable = pagetable;
-  p->sz = sz;
+  p->tg->sz = sz;
   p->trapframe->epc = elf.entry;  // initial program counter = main
   p->trapframe->sp = sp; // initial stack pointer
+  mmapclose(oldpagetable, p->tg->vma);
   proc_freepagetable(oldpagetable, oldsz);
 
+  // Swap in the new segments, each holding its own reference to ip.
+  begin_op();
+  vmafree(p->tg->vma);
+  for(i = 0; i < nvma; i++)
+    idup(ip);
+  memmove(p->tg->vma, vma, sizeof(p->tg->vma));
+  iput(ip);
+  end_op();
+  kfree((void*)vma);
+
   return argc; // this ends up in a0, the first argument to main(argc, argv)
 
  bad:
   if(pagetable)
     proc_freepagetable(pagetable, sz);
-  if(ip){
-    iunlockput(ip);
+  if(vma)
+    kfree((void*)vma);
+  if(locked){
+    iunlockshared(ip);
+    iput(ip);
+    end_op();
+  } else {
+    begin_op();
+    iput(ip);
     end_op();
   }
   return -1;
 }
-
-// Load a program segment into pagetable at virtual address va.
-// va must be page-aligned
-// and the pages from va to va+sz must already be mapped.
-// Returns 0 on success, -1 on failure.
-static int
-loadseg(pagetable_t pagetable, uint64 va, struct inode *ip, uint offset, uint sz)
-{
-  uint i, n;
-  uint64 pa;
-
-  for(i = 0; i < sz; i += PGSIZE){
-    pa = walkaddr(pagetable, va + i);
-    if(pa == 0)
-      panic("loadseg: address should exist");
-    if(sz - i < PGSIZE)
-      n = sz - i;
-    else
-      n = PGSIZE;
-    if(readi(ip, 0, (uint64)pa, offset+i, n) != n)
-      return -1;
-  }
-  
-  return 0;
-}
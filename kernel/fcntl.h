@@ -4,3 +4,19 @@
 #define O_CREATE  0x200
 #define O_TRUNC   0x400
 #define O_SMALLFILE 0x800 // Small file flag
+
+// lseek() whence
+#define SEEK_SET  0
+#define SEEK_CUR  1
+#define SEEK_END  2
+
+// mmap() protection and flags
+#define PROT_READ     0x1
+#define PROT_WRITE    0x2
+#define PROT_EXEC     0x4
+
+#define MAP_SHARED    0x01
+#define MAP_PRIVATE   0x02
+#define MAP_ANONYMOUS 0x20
+
+#define MAP_FAILED    ((void*)-1)
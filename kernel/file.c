@@ -13,6 +13,8 @@
 #include "file.h"
 #include "stat.h"
 #include "proc.h"
+#include "fcntl.h"
+#include "uio.h"
 
 struct devsw devsw[NDEV];
 struct {
@@ -25,9 +27,19 @@ extern struct log log;
 void
 fileinit(void)
 {
+  struct file* f;
+
   initlock(&ftable.lock, "ftable");
+  for (f = ftable.file; f < ftable.file + NFILE; f++)
+    initsleeplock(&f->offlock, "file offset");
 }
 
+// A file's reference count changes atomically, without
+// ftable.lock, since every fd system call takes and drops a
+// reference. Only the drop of the last reference, which frees
+// the file, is made under ftable.lock, so filealloc() never
+// sees a file whose count is zero but is still being closed.
+
 // Allocate a file structure.
 struct file*
   filealloc(void)
@@ -50,11 +62,8 @@ struct file*
 struct file*
   filedup(struct file* f)
 {
-  acquire(&ftable.lock);
-  if (f->ref < 1)
+  if (__atomic_fetch_add(&f->ref, 1, __ATOMIC_ACQ_REL) < 1)
     panic("filedup");
-  f->ref++;
-  release(&ftable.lock);
   return f;
 }
 
@@ -63,16 +72,23 @@ void
 fileclose(struct file* f)
 {
   struct file ff;
+  int ref;
+
+  // drop a reference that is not the last without the lock.
+  while ((ref = __atomic_load_n(&f->ref, __ATOMIC_ACQUIRE)) > 1)
+    if (__atomic_compare_exchange_n(&f->ref, &ref, ref - 1, 0,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+      return;
 
   acquire(&ftable.lock);
   if (f->ref < 1)
     panic("fileclose");
-  if (--f->ref > 0) {
+  if (__atomic_sub_fetch(&f->ref, 1, __ATOMIC_ACQ_REL) > 0) {
+    // another thread took a reference meanwhile.
     release(&ftable.lock);
     return;
   }
   ff = *f;
-  f->ref = 0;
   f->type = FD_NONE;
   release(&ftable.lock);
 
@@ -87,7 +103,7 @@ fileclose(struct file* f)
 }
 
 // Flush the in-memory log to disk and initiate commit
-// Called at process exit
+// Called by the flush() system call
 void
 fflush()
 { 
@@ -115,13 +131,6 @@ fflush()
   }
 }
 
-void
-launch_commit_worker()
-{
-  printf("Entering commit loop\n");
-  commit_loop();
-}
-
 
 // Get metadata about file f.
 // addr is a user virtual address, pointing to a struct stat.
@@ -132,9 +141,9 @@ filestat(struct file* f, uint64 addr)
   struct stat st;
 
   if (f->type == FD_INODE || f->type == FD_DEVICE) {
-    ilock(f->ip);
+    ilockshared(f->ip);
     stati(f->ip, &st);
-    iunlock(f->ip);
+    iunlockshared(f->ip);
     if (copyout(p->pagetable, addr, (char*)&st, sizeof(st)) < 0)
       return -1;
     return 0;
@@ -142,6 +151,54 @@ filestat(struct file* f, uint64 addr)
   return -1;
 }
 
+// Read n bytes at offset off of inode file f into user
+// address addr, sharing the inode lock with other readers.
+static int
+inoderead(struct file* f, uint64 addr, int n, uint off)
+{
+  int r;
+
+  ilockshared(f->ip);
+  r = readi(f->ip, 1, addr, off, n);
+  iunlockshared(f->ip);
+  return r;
+}
+
+// Write n bytes at user address addr to inode file f at
+// offset off. Returns the number of bytes written, which is
+// less than n if there was an error.
+static int
+inodewrite(struct file* f, uint64 addr, int n, uint off)
+{
+  // write a few blocks at a time to avoid exceeding
+  // the maximum log transaction size.
+  // this really belongs lower down, since writei()
+  // might be writing a device like the console.
+  int max = MAXOPBYTES;
+  int i = 0, r;
+
+  while (i < n) {
+    int n1 = n - i;
+    if (n1 > max)
+      n1 = max;
+
+    begin_op();
+    debug("Write Transaction begins\n");
+    ilock(f->ip);
+    r = writei(f->ip, 1, addr + i, off + i, n1);
+    iunlock(f->ip);
+    end_op();
+    debug("Write Transaction completed\n");
+    if (r > 0)
+      i += r;
+    if (r != n1) {
+      // error from writei
+      break;
+    }
+  }
+  return i;
+}
+
 // Read from file f.
 // addr is a user virtual address.
 int
@@ -152,6 +209,9 @@ fileread(struct file* f, uint64 addr, int n)
   if (f->readable == 0)
     return -1;
 
+  if (n > 0)
+    vmaprefault(addr, n);
+
   if (f->type == FD_PIPE) {
     r = piperead(f->pipe, addr, n);
   }
@@ -161,10 +221,12 @@ fileread(struct file* f, uint64 addr, int n)
     r = devsw[f->major].read(1, addr, n);
   }
   else if (f->type == FD_INODE) {
-    ilock(f->ip);
-    if ((r = readi(f->ip, 1, addr, f->off, n)) > 0)
+    // Readers share the inode lock, so processes sharing f
+    // need offlock to read and advance f->off in one step.
+    acquiresleep(&f->offlock);
+    if ((r = inoderead(f, addr, n, f->off)) > 0)
       f->off += r;
-    iunlock(f->ip);
+    releasesleep(&f->offlock);
   }
   else {
     panic("fileread");
@@ -183,6 +245,9 @@ filewrite(struct file* f, uint64 addr, int n)
   if (f->writable == 0)
     return -1;
 
+  if (n > 0)
+    vmaprefault(addr, n);
+
   if (f->type == FD_PIPE) {
     ret = pipewrite(f->pipe, addr, n);
   }
@@ -192,40 +257,238 @@ filewrite(struct file* f, uint64 addr, int n)
     ret = devsw[f->major].write(1, addr, n);
   }
   else if (f->type == FD_INODE) {
-    // write a few blocks at a time to avoid exceeding
-    // the maximum log transaction size, including
-    // i-node, indirect block, allocation blocks,
-    // and 2 blocks of slop for non-aligned writes.
-    // this really belongs lower down, since writei()
-    // might be writing a device like the console.
-    int max = ((MAXOPBLOCKS - 1 - 1 - 2) / 2) * BSIZE;
-    int i = 0;
-    while (i < n) {
-      int n1 = n - i;
-      if (n1 > max)
-        n1 = max;
-
-      begin_op();
-      debug("Write Transaction begins\n");
-      ilock(f->ip);
-      if ((r = writei(f->ip, 1, addr + i, f->off, n1)) > 0)
+    acquiresleep(&f->offlock);
+    r = inodewrite(f, addr, n, f->off);
+    f->off += r;
+    releasesleep(&f->offlock);
+    ret = (r == n ? n : -1);
+  }
+  else {
+    panic("filewrite");
+  }
+
+  return ret;
+}
+
+// Read from inode file f at offset off, leaving f->off alone,
+// so that processes sharing f need not take turns with it.
+int
+filereadat(struct file* f, uint64 addr, int n, uint off)
+{
+  if (f->readable == 0 || f->type != FD_INODE || n < 0)
+    return -1;
+
+  if (n > 0)
+    vmaprefault(addr, n);
+  return inoderead(f, addr, n, off);
+}
+
+// Write to inode file f at offset off, leaving f->off alone.
+int
+filewriteat(struct file* f, uint64 addr, int n, uint off)
+{
+  if (f->writable == 0 || f->type != FD_INODE || n < 0)
+    return -1;
+
+  if (n > 0)
+    vmaprefault(addr, n);
+  return inodewrite(f, addr, n, off) == n ? n : -1;
+}
+
+// Set the offset of inode file f to off, relative to the start
+// of the file, the current offset, or the end of the file, as
+// whence is SEEK_SET, SEEK_CUR or SEEK_END. The offset may not
+// go past the end of the file, since files have no holes.
+// Returns the new offset, or -1.
+int
+fileseek(struct file* f, int off, int whence)
+{
+  int base, r;
+
+  if (f->type != FD_INODE)
+    return -1;
+
+  acquiresleep(&f->offlock);
+  ilockshared(f->ip);
+  if (whence == SEEK_SET)
+    base = 0;
+  else if (whence == SEEK_CUR)
+    base = f->off;
+  else if (whence == SEEK_END)
+    base = f->ip->size;
+  else
+    base = -1;
+  r = -1;
+  if (base >= 0 && base + off >= 0 && base + off <= f->ip->size) {
+    f->off = base + off;
+    r = f->off;
+  }
+  iunlockshared(f->ip);
+  releasesleep(&f->offlock);
+  return r;
+}
+
+// Read from file f into the n user buffers of iov, filling
+// each before the next, as one read() of their total length.
+// iov is in kernel memory; the caller checked the lengths.
+int
+filereadv(struct file* f, struct iovec* iov, int n)
+{
+  int i, r, tot;
+
+  if (f->readable == 0)
+    return -1;
+
+  if (f->type != FD_INODE) {
+    for (tot = 0, i = 0; i < n; i++) {
+      if ((r = fileread(f, (uint64)iov[i].iov_base, iov[i].iov_len)) < 0)
+        return tot > 0 ? tot : -1;
+      tot += r;
+      if (r < iov[i].iov_len)
+        break;
+    }
+    return tot;
+  }
+
+  for (i = 0; i < n; i++)
+    if (iov[i].iov_len > 0)
+      vmaprefault((uint64)iov[i].iov_base, iov[i].iov_len);
+
+  // One pass through readi() for all the buffers.
+  acquiresleep(&f->offlock);
+  ilockshared(f->ip);
+  for (tot = 0, i = 0; i < n; i++) {
+    r = readi(f->ip, 1, (uint64)iov[i].iov_base, f->off, iov[i].iov_len);
+    if (r < 0) {
+      if (tot == 0)
+        tot = -1;
+      break;
+    }
+    f->off += r;
+    tot += r;
+    if (r < iov[i].iov_len)
+      break;
+  }
+  iunlockshared(f->ip);
+  releasesleep(&f->offlock);
+  return tot;
+}
+
+// Write the n user buffers of iov to file f, one after the
+// other, as one write() of their total length. For an inode,
+// the buffers are gathered into transactions of the size
+// filewrite() uses, rather than at least one per buffer.
+int
+filewritev(struct file* f, struct iovec* iov, int n)
+{
+  int max = MAXOPBYTES;
+  int i, m, k, r, tot, err;
+  uint64 done;
+
+  if (f->writable == 0)
+    return -1;
+
+  if (f->type != FD_INODE) {
+    for (tot = 0, i = 0; i < n; i++) {
+      if (filewrite(f, (uint64)iov[i].iov_base, iov[i].iov_len) != iov[i].iov_len)
+        return -1;
+      tot += iov[i].iov_len;
+    }
+    return tot;
+  }
+
+  for (i = 0; i < n; i++)
+    if (iov[i].iov_len > 0)
+      vmaprefault((uint64)iov[i].iov_base, iov[i].iov_len);
+
+  acquiresleep(&f->offlock);
+  tot = 0;
+  err = 0;
+  i = 0;
+  done = 0; // bytes of iov[i] written so far
+  while (i < n && !err) {
+    // The bytes of one transaction are contiguous in the file,
+    // so they need no more log blocks than one filewrite() chunk.
+    begin_op();
+    ilock(f->ip);
+    for (m = 0; m < max && i < n; ) {
+      k = iov[i].iov_len - done;
+      if (k > max - m)
+        k = max - m;
+      r = writei(f->ip, 1, (uint64)iov[i].iov_base + done, f->off, k);
+      if (r > 0) {
         f->off += r;
-      iunlock(f->ip);
-      end_op();
-      debug("Write Transaction completed\n");
-      if (r != n1) {
+        m += r;
+        done += r;
+        tot += r;
+      }
+      if (r != k) {
         // error from writei
+        err = 1;
         break;
       }
-      i += r;
+      if (done == iov[i].iov_len) {
+        i++;
+        done = 0;
+      }
     }
-    ret = (i == n ? n : -1);
-  }
-  else {
-    panic("filewrite");
+    iunlock(f->ip);
+    end_op();
   }
+  releasesleep(&f->offlock);
+  return err ? -1 : tot;
+}
 
-  return ret;
+// Wait until what has been written to inode file f is on
+// disk: everything, or with data, only what is needed to read
+// its contents back, so not changes such as its link count.
+// Only the transactions that touched the inode are waited for.
+int
+filesync(struct file* f, int data)
+{
+  uint id;
+
+  if (f->type != FD_INODE)
+    return -1;
+
+  ilockshared(f->ip);
+  id = data ? f->ip->datatxid : f->ip->txid;
+  iunlockshared(f->ip);
+  logsync(id);
+  return 0;
+}
+
+// Move up to n bytes from file in to file out inside the
+// kernel, without copying them through user memory. One of
+// the two must be a pipe; the data goes straight between its
+// buffer and the other file. With keep, as for tee(), both must
+// be pipes, and the data stays in in as well.
+// Returns the number of bytes moved, 0 at end of file, or -1.
+int
+filesplice(struct file* in, struct file* out, int n, int keep)
+{
+  int r;
+
+  if (in->readable == 0 || out->writable == 0 || n < 0)
+    return -1;
+
+  if (in->type == FD_PIPE && out->type == FD_PIPE)
+    return pipetopipe(in->pipe, out->pipe, n, keep);
+  if (keep)
+    return -1;
+  if (in->type == FD_INODE && out->type == FD_PIPE) {
+    acquiresleep(&in->offlock);
+    r = pipefromi(out->pipe, in->ip, &in->off, n);
+    releasesleep(&in->offlock);
+    return r;
+  }
+  if (in->type == FD_PIPE && out->type == FD_INODE) {
+    acquiresleep(&out->offlock);
+    r = pipetoi(in->pipe, out->ip, &out->off, n);
+    releasesleep(&out->offlock);
+    return r;
+  }
+  return -1;
 }
 
 // Truncate file f to length n.
@@ -236,6 +499,7 @@ int filetruncate(struct file* f, int length) {
 
   if (f->type == FD_INODE) {
 
+    acquiresleep(&f->offlock);
     begin_op();
     ilock(f->ip);
 
@@ -244,6 +508,7 @@ int filetruncate(struct file* f, int length) {
 
     iunlock(f->ip);
     end_op();
+    releasesleep(&f->offlock);
     return 0;
   }
   return -1;
@@ -6,6 +6,7 @@ struct file {
   struct pipe *pipe; // FD_PIPE
   struct inode *ip;  // FD_INODE and FD_DEVICE
   uint off;          // FD_INODE
+  struct sleeplock offlock; // serializes uses of off
   short major;       // FD_DEVICE
 };
 
@@ -18,6 +19,7 @@ struct inode {
   uint dev;           // Device number
   uint inum;          // Inode number
   int ref;            // Reference count
+  int mapwrite;       // mapped MAP_SHARED and writable since iget()?
   struct sleeplock lock; // protects everything below here
   int valid;          // inode has been read from disk?
 
@@ -27,6 +29,9 @@ struct inode {
   short nlink;
   uint size;
   uint addrs[NDIRECT+1];
+
+  uint txid;          // last transaction that changed the inode
+  uint datatxid;      // last one that changed its contents or size
 };
 
 // map major device number to device functions.
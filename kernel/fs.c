@@ -168,6 +168,11 @@ bfree(int dev, uint b)
 // have locked the inodes involved; this lets callers create
 // multi-step atomic operations.
 //
+// Code that only reads an inode and its content, such as read()
+// and pathname lookup, may lock it with ilockshared() instead,
+// so that any number of readers can hold it at once. They must
+// not change anything in the inode, its content, or its blocks.
+//
 // The itable.lock spin-lock protects the allocation of itable
 // entries. Since ip->ref indicates whether an entry is free,
 // and ip->dev and ip->inum indicate which i-node an entry
@@ -180,6 +185,7 @@ bfree(int dev, uint b)
 struct {
   struct spinlock lock;
   struct inode inode[NINODE];
+  uint lost;   // latest txid of any inode whose entry was let go
 } itable;
 
 void
@@ -244,6 +250,7 @@ iupdate(struct inode* ip)
   memmove(dip->addrs, ip->addrs, sizeof(ip->addrs));
   log_write(bp);
   brelse(bp);
+  ip->txid = logtxid();
 }
 
 // Find the inode with number inum on device dev
@@ -277,6 +284,11 @@ iget(uint dev, uint inum)
   ip->inum = inum;
   ip->ref = 1;
   ip->valid = 0;
+  // every mapping held a reference, so all are gone.
+  ip->mapwrite = 0;
+  // the inode's own txids went with its last entry.
+  ip->txid = itable.lost;
+  ip->datatxid = itable.lost;
   release(&itable.lock);
 
   return ip;
@@ -332,6 +344,33 @@ iunlock(struct inode* ip)
   releasesleep(&ip->lock);
 }
 
+// Lock the given inode shared with other readers.
+// Reads the inode from disk if necessary.
+void
+ilockshared(struct inode* ip)
+{
+  if (ip == 0 || ip->ref < 1)
+    panic("ilockshared");
+
+  // Reading the inode in needs it locked exclusively. Once
+  // valid it stays valid while we hold a reference.
+  if (ip->valid == 0) {
+    ilock(ip);
+    iunlock(ip);
+  }
+  acquiresleepshared(&ip->lock);
+}
+
+// Unlock the given inode, locked by ilockshared().
+void
+iunlockshared(struct inode* ip)
+{
+  if (ip == 0 || ip->ref < 1)
+    panic("iunlockshared");
+
+  releasesleepshared(&ip->lock);
+}
+
 // Drop a reference to an in-memory inode.
 // If that was the last reference, the inode table entry can
 // be recycled.
@@ -368,6 +407,8 @@ iput(struct inode* ip)
     acquire(&itable.lock);
   }
 
+  if (ip->ref == 1 && ip->txid > itable.lost)
+    itable.lost = ip->txid;
   ip->ref--;
   release(&itable.lock);
 }
@@ -440,6 +481,8 @@ itrunc(struct inode* ip)
   struct buf* bp;
   uint* a;
 
+  pcinval(ip);
+
   for (i = 0; i < NDIRECT; i++) {
     if (ip->addrs[i]) {
       bfree(ip->dev, ip->addrs[i]);
@@ -461,10 +504,11 @@ itrunc(struct inode* ip)
 
   ip->size = 0;
   iupdate(ip);
+  ip->datatxid = ip->txid;
 }
 
 // Copy stat information from inode.
-// Caller must hold ip->lock.
+// Caller must hold ip->lock, shared or exclusive.
 void
 stati(struct inode* ip, struct stat* st)
 {
@@ -477,13 +521,15 @@ stati(struct inode* ip, struct stat* st)
 
 
 // Read data from inode.
-// Caller must hold ip->lock.
+// Caller must hold ip->lock, shared or exclusive. Every block
+// below ip->size exists, so bmap() allocates nothing here.
 // If user_dst==1, then dst is a user virtual address;
 // otherwise, dst is a kernel address.
 int
 readi(struct inode* ip, int user_dst, uint64 dst, uint off, uint n)
 {
   uint tot, m;
+  int r;
   struct buf* bp;
 
   if (off > ip->size || off + n < off)
@@ -493,6 +539,8 @@ readi(struct inode* ip, int user_dst, uint64 dst, uint off, uint n)
 
   // Handle small files read by reading directly from the inode
   if (ip->type == T_SMALLFILE) {
+    if (ip->mapwrite && (r = pcread(ip, user_dst, dst, off, n)) != 0)
+      return r;
     uint maxFileSize = sizeof(uint) * (NDIRECT + 1);
 
     if (off > ip->size || off + n < off || off + n > maxFileSize) {
@@ -512,6 +560,15 @@ readi(struct inode* ip, int user_dst, uint64 dst, uint off, uint n)
 
   // debug("readi: normal file\n");
   for (tot = 0; tot < n; tot += m, off += m, dst += m) {
+    // a cached page may hold stores through a mapping.
+    if (ip->mapwrite && (r = pcread(ip, user_dst, dst, off, n - tot)) != 0) {
+      if (r < 0) {
+        tot = -1;
+        break;
+      }
+      m = r;
+      continue;
+    }
     uint addr = bmap(ip, off / BSIZE);
     if (addr == 0)
       break;
@@ -573,11 +630,13 @@ writei(struct inode* ip, int user_src, uint64 src, uint off, uint n)
     debug("writei: small file\n");
 
     either_copyin((char*)(ip->addrs) + off, user_src, src, n);
+    pcwrite(ip, off, (char*)(ip->addrs) + off, n);
 
     ip->size = max(ip->size, off + n);
     debug("writei: %d bytes to small file at offset %d, new size: %d\n", n, off, ip->size);
 
     iupdate(ip);
+    ip->datatxid = ip->txid;
 
     return n;
   }
@@ -592,6 +651,7 @@ writei(struct inode* ip, int user_src, uint64 src, uint off, uint n)
       brelse(bp);
       break;
     }
+    pcwrite(ip, off, (char*)bp->data + (off % BSIZE), m);
     log_write(bp);
     brelse(bp);
   }
@@ -606,6 +666,7 @@ writei(struct inode* ip, int user_src, uint64 src, uint off, uint n)
   // because the loop above might have called bmap() and added a new
   // block to ip->addrs[].
   iupdate(ip);
+  ip->datatxid = ip->txid;
 
   return tot;
 }
@@ -620,6 +681,7 @@ namecmp(const char* s, const char* t)
 
 // Look for a directory entry in a directory.
 // If found, set *poff to byte offset of entry.
+// Caller must hold dp->lock, shared or exclusive.
 struct inode*
   dirlookup(struct inode* dp, char* name, uint* poff)
 {
@@ -728,24 +790,25 @@ namex(char* path, int nameiparent, char* name)
   if (*path == '/')
     ip = iget(ROOTDEV, ROOTINO);
   else
-    ip = idup(myproc()->cwd);
+    ip = cwdget();
 
   while ((path = skipelem(path, name)) != 0) {
-    ilock(ip);
+    ilockshared(ip);
     if (ip->type != T_DIR) {
-      iunlockput(ip);
+      iunlockshared(ip);
+      iput(ip);
       return 0;
     }
     if (nameiparent && *path == '\0') {
       // Stop one level early.
-      iunlock(ip);
+      iunlockshared(ip);
       return ip;
     }
-    if ((next = dirlookup(ip, name, 0)) == 0) {
-      iunlockput(ip);
+    next = dirlookup(ip, name, 0);
+    iunlockshared(ip);
+    iput(ip);
+    if (next == 0)
       return 0;
-    }
-    iunlockput(ip);
     ip = next;
   }
   if (nameiparent) {
@@ -775,6 +838,8 @@ void truncate(struct inode* ip, int length) {
   struct buf* bp;
   uint* a;
 
+  pcinval(ip);
+
   // Handle small file truncation
   if (ip->type == T_SMALLFILE) {
 
@@ -915,4 +980,5 @@ void truncate(struct inode* ip, int length) {
 
     debug("truncate: new size = %d\n", ip->size);
   }
+  ip->txid = ip->datatxid = logtxid();
 }
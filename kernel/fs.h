@@ -28,6 +28,11 @@ struct superblock {
 #define NINDIRECT (BSIZE / sizeof(uint))
 #define MAXFILE (NDIRECT + NINDIRECT)
 
+// Most bytes one log transaction may write to a file: leaves
+// room in MAXOPBLOCKS for the i-node, an indirect block,
+// allocation blocks, and 2 blocks of slop for non-aligned writes.
+#define MAXOPBYTES (((MAXOPBLOCKS-1-1-2) / 2) * BSIZE)
+
 // On-disk inode structure
 struct dinode {
   short type;           // File type
@@ -0,0 +1,77 @@
+//
+// Futexes: sleeping and waking on a word of user memory,
+// for the locks of user threads (see user/thread.c).
+//
+// A waiter sleeps only if the word still holds the value it
+// expects, checked with futexlock held; a waker changes the
+// word first and then wakes with futexlock held, so a waiter
+// either sees the change or is asleep in time to be woken.
+// The wait channel is the word's physical address, which is
+// the same for every thread, and for every process that
+// shares the page.
+//
+
+#include "types.h"
+#include "riscv.h"
+#include "defs.h"
+#include "param.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "futex.h"
+
+struct spinlock futexlock;
+
+void
+futexinit(void)
+{
+  initlock(&futexlock, "futex");
+}
+
+// Perform futex operation op on the int at user address addr.
+// FUTEX_WAIT returns 0 once woken, or -1 at once if *addr != val.
+// FUTEX_WAKE returns how many threads it woke.
+// Both return -1 if addr is bad.
+int
+futex(uint64 addr, int op, int val)
+{
+  struct proc *p = myproc();
+  uint64 pa;
+  int cur, n;
+
+  if(addr % sizeof(int) != 0)
+    return -1;
+  // fault the page in, which may sleep.
+  if(copyin(p->pagetable, (char*)&cur, addr, sizeof(cur)) < 0)
+    return -1;
+
+  acquire(&futexlock);
+  // another thread's munmap() may free the page once pglock
+  // is released; a later waker then finds no sleeper on pa,
+  // or wakes one spuriously, which futex users allow for.
+  acquire(&p->tg->pglock);
+  if((pa = walkaddr(p->pagetable, addr)) == 0){
+    release(&p->tg->pglock);
+    release(&futexlock);
+    return -1;
+  }
+  pa += addr % PGSIZE;
+  cur = *(int*)pa;
+  release(&p->tg->pglock);
+
+  if(op == FUTEX_WAIT){
+    if(cur != val || killed(p)){
+      release(&futexlock);
+      return -1;
+    }
+    sleep((void*)pa, &futexlock);
+    release(&futexlock);
+    return 0;
+  }
+  if(op == FUTEX_WAKE){
+    n = wakeupn((void*)pa, val);
+    release(&futexlock);
+    return n;
+  }
+  release(&futexlock);
+  return -1;
+}
@@ -0,0 +1,56 @@
+// A ring of file operations, in user memory, that one io_enter()
+// system call runs as a batch.
+//
+// The process queues operations in sq[sqtail % IORING_SIZE] and
+// advances sqtail. io_enter() runs the queued operations in order,
+// advancing sqhead past each, and posts each one's result in
+// cq[cqtail % IORING_SIZE], advancing cqtail. The process reads
+// results from cqhead and advances it; io_enter() stops when cq
+// is full. Indexes only increase, wrapping at 2^32.
+//
+// The operations run on the calling thread, before io_enter()
+// returns. A kthread_create() worker could run them while the
+// process computes, but a kernel thread has no user memory or
+// open files: it would have to borrow the submitter's page
+// table, file table and cwd, keep them alive past its exit(),
+// and be held off by munmap() like the group's own threads.
+// Each operation would still wait for its disk blocks one at a
+// time, since bread() sleeps until the virtio request is done.
+// So io_enter() saves the trap per operation, not the wait.
+
+#define IORING_SIZE 32   // entries in each ring; a power of two
+
+// operations
+#define IO_NOP    0
+#define IO_READ   1      // read(fd, addr, len), or pread() at off
+#define IO_WRITE  2      // write(fd, addr, len), or pwrite() at off
+#define IO_OPEN   3      // open(addr, flags); the result is the fd
+#define IO_CLOSE  4      // close(fd)
+#define IO_FSYNC  5      // fsync(fd)
+#define IO_FDATASYNC 6   // fdatasync(fd)
+
+struct iosqe {
+  int op;
+  int fd;
+  uint64 addr;       // buffer, or path for IO_OPEN
+  int len;
+  int flags;         // open mode for IO_OPEN
+  int off;           // file offset, or -1 to use and move fd's
+  int pad;
+  uint64 data;       // copied to the completion, to match them up
+};
+
+struct iocqe {
+  uint64 data;       // the operation's data
+  int res;           // what its system call would have returned
+  int pad;
+};
+
+struct ioring {
+  uint sqhead;       // next operation io_enter() will run
+  uint sqtail;       // where the process queues the next one
+  uint cqhead;       // next completion the process will read
+  uint cqtail;       // where io_enter() posts the next one
+  struct iosqe sq[IORING_SIZE];
+  struct iocqe cq[IORING_SIZE];
+};
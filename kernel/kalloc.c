@@ -1,6 +1,17 @@
 // Physical memory allocator, for user processes,
 // kernel stacks, page-table pages,
 // and pipe buffers. Allocates whole 4096-byte pages.
+//
+// Each page has a reference count so that a page can be
+// mapped by several processes (shared program text) and
+// held by the file page cache at the same time. kalloc()
+// returns a page with one reference, kdup() adds one, and
+// kfree() drops one, freeing the page when none remain.
+//
+// The top NMEGA 2MB-aligned blocks of RAM are kept whole for
+// user megapages (megaalloc()). kalloc() breaks a block up into
+// ordinary pages once the free list is empty; those pages never
+// rejoin the megapage list.
 
 #include "types.h"
 #include "param.h"
@@ -18,16 +29,26 @@ struct run {
   struct run *next;
 };
 
+#define PA2REF(pa) (((uint64)(pa) - KERNBASE) / PGSIZE)
+
+#define MEGABASE (PHYSTOP - NMEGA*MEGAPGSIZE)
+
 struct {
   struct spinlock lock;
   struct run *freelist;
+  struct run *megalist;      // free 2MB blocks
+  int ref[PA2REF(PHYSTOP)];  // references to each page, under lock
 } kmem;
 
 void
 kinit()
 {
+  char *p;
+
   initlock(&kmem.lock, "kmem");
-  freerange(end, (void*)PHYSTOP);
+  freerange(end, (void*)MEGABASE);
+  for(p = (char*)MEGABASE; p < (char*)PHYSTOP; p += MEGAPGSIZE)
+    megafree(p);
 }
 
 void
@@ -35,14 +56,17 @@ freerange(void *pa_start, void *pa_end)
 {
   char *p;
   p = (char*)PGROUNDUP((uint64)pa_start);
-  for(; p + PGSIZE <= (char*)pa_end; p += PGSIZE)
+  for(; p + PGSIZE <= (char*)pa_end; p += PGSIZE){
+    kmem.ref[PA2REF(p)] = 1;
     kfree(p);
+  }
 }
 
-// Free the page of physical memory pointed at by pa,
-// which normally should have been returned by a
-// call to kalloc().  (The exception is when
-// initializing the allocator; see kinit above.)
+// Drop a reference to the page of physical memory pointed
+// at by pa, which normally should have been returned by a
+// call to kalloc(), and free it if that was the last one.
+// (The exception is when initializing the allocator; see
+// kinit above.)
 void
 kfree(void *pa)
 {
@@ -51,6 +75,15 @@ kfree(void *pa)
   if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
     panic("kfree");
 
+  acquire(&kmem.lock);
+  if(kmem.ref[PA2REF(pa)] < 1)
+    panic("kfree: ref");
+  if(--kmem.ref[PA2REF(pa)] > 0){
+    release(&kmem.lock);
+    return;
+  }
+  release(&kmem.lock);
+
   // Fill with junk to catch dangling refs.
   memset(pa, 1, PGSIZE);
 
@@ -71,12 +104,99 @@ kalloc(void)
   struct run *r;
 
   acquire(&kmem.lock);
+  if(kmem.freelist == 0 && kmem.megalist != 0){
+    // out of pages: break up a megapage block.
+    r = kmem.megalist;
+    kmem.megalist = r->next;
+    for(int i = 0; i < MEGAPGSIZE; i += PGSIZE){
+      struct run *q = (struct run*)((char*)r + i);
+      q->next = kmem.freelist;
+      kmem.freelist = q;
+    }
+  }
   r = kmem.freelist;
-  if(r)
+  if(r){
     kmem.freelist = r->next;
+    kmem.ref[PA2REF(r)] = 1;
+  }
   release(&kmem.lock);
 
   if(r)
     memset((char*)r, 5, PGSIZE); // fill with junk
   return (void*)r;
 }
+
+// Add a reference to a page returned by kalloc(),
+// so that it survives one more kfree().
+void
+kdup(void *pa)
+{
+  if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
+    panic("kdup");
+
+  acquire(&kmem.lock);
+  if(kmem.ref[PA2REF(pa)] < 1)
+    panic("kdup: free page");
+  kmem.ref[PA2REF(pa)]++;
+  release(&kmem.lock);
+}
+
+// Return the number of references to a page returned by kalloc().
+int
+krefs(void *pa)
+{
+  int n;
+
+  if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
+    panic("krefs");
+
+  acquire(&kmem.lock);
+  n = kmem.ref[PA2REF(pa)];
+  release(&kmem.lock);
+  return n;
+}
+
+// Allocate one 2MB-aligned megapage of physical memory,
+// or return 0 if none is left.
+void *
+megaalloc(void)
+{
+  struct run *r;
+
+  acquire(&kmem.lock);
+  r = kmem.megalist;
+  if(r)
+    kmem.megalist = r->next;
+  release(&kmem.lock);
+  return (void*)r;
+}
+
+// Free a megapage returned by megaalloc().
+void
+megafree(void *pa)
+{
+  struct run *r;
+
+  if(((uint64)pa % MEGAPGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
+    panic("megafree");
+
+  r = (struct run*)pa;
+  acquire(&kmem.lock);
+  r->next = kmem.megalist;
+  kmem.megalist = r;
+  release(&kmem.lock);
+}
+
+// Turn a megapage returned by megaalloc() into 512 ordinary
+// pages with one reference each, to be freed with kfree().
+void
+megabreak(void *pa)
+{
+  if(((uint64)pa % MEGAPGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
+    panic("megabreak");
+
+  acquire(&kmem.lock);
+  for(int i = 0; i < MEGAPGSIZE; i += PGSIZE)
+    kmem.ref[PA2REF((char*)pa + i)] = 1;
+  release(&kmem.lock);
+}
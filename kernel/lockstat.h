@@ -0,0 +1,14 @@
+// Statistics of one class of locks, the locks sharing a name,
+// as returned by the lockstat() system call.
+// Times are in r_time() units; the clock runs at 10MHz in qemu.
+struct lockstat {
+  char name[16];
+  int sleep;         // Sleep locks rather than spin locks?
+  uint64 nacquire;   // Acquisitions
+  uint64 ncontended; // Acquisitions that had to wait
+  uint64 nspin;      // Times round the loop (spin) or asleep (sleep) waiting
+  uint64 waittime;   // Total time waiting to acquire
+  uint64 maxwait;    // Longest wait
+  uint64 holdtime;   // Total time held
+  uint64 maxhold;    // Longest held
+};
@@ -7,6 +7,9 @@
 #include "fs.h"
 #include "buf.h"
 #include "log.h"
+#include "proc.h"
+#include "sched.h"
+#include "logstat.h"
 
 // Simple logging that allows concurrent FS system calls.
 //
@@ -49,6 +52,7 @@ initlog(int dev, struct superblock *sb)
   log.start = sb->logstart;
   log.size = sb->nlog;
   log.dev = dev;
+  log.txid = 1;
   recover_from_log();
 }
 
@@ -117,7 +121,12 @@ begin_op(void)
   acquire(&log.lock);
   while(1){
 
-    if(log.lh.n + (log.outstanding+1)*MAXOPBLOCKS > LOGSIZE){
+    if(log.draining){
+      // a copy is waiting for the log to be quiet, or running.
+      sleep(&log, &log.lock);
+    }
+
+    else if(log.lh.n + (log.outstanding+1)*MAXOPBLOCKS > LOGSIZE){
       // this op might exhaust log space; wait for blocks to be copied to disk log
 
       release(&log.lock);
@@ -171,6 +180,8 @@ end_op(void)
 {
   acquire(&log.lock);
     log.outstanding -= 1;
+    if(log.outstanding == 0 && log.draining)
+      wakeup(&log);
   release(&log.lock);  
   
   debug("[END OP] Ending transaction...\n");
@@ -194,6 +205,7 @@ write_log(void)
 }
 
 /* Call this function while holding commitLock. It releases the lock before returning */
+/* The caller must not be inside begin_op()/end_op(). */
 void
 copy_and_initiate_commit()
 {
@@ -202,6 +214,16 @@ copy_and_initiate_commit()
     // Release the lock while performing I/O
     release(&log.commitLock);
 
+    // Let the FS system calls in progress finish, and start
+    // no new ones until the copy is done, so that no block is
+    // added to or absorbed into the log while it is copied.
+    // Every op stamped with log.txid is then in this copy.
+    acquire(&log.lock);
+      log.draining = 1;
+      while (log.outstanding > 0)
+        sleep(&log, &log.lock);
+    release(&log.lock);
+
     // Copy
     debug("[COPY] Copy begins!\n");
     write_log();
@@ -211,6 +233,8 @@ copy_and_initiate_commit()
     acquire(&log.lock);
       numCommitBlocks = log.lh.n;
       log.lh.n = 0;
+      log.durable = log.txid++;
+      log.draining = 0;
 
       for (int i = 0; i < LOGSIZE; i++){
         commitBlocks[i] = log.lh.block[i];
@@ -240,7 +264,11 @@ copy_and_initiate_commit()
 
   else{
     debug("WARNING: copy attempted when commit in progress\n");
+    // Give up the attempt, or the commit thread would wait
+    // for this copy forever and never install the commit.
+    log.copying = 0;
     release(&log.commitLock);
+    wakeup(&log);
     return;
   }
     
@@ -280,6 +308,82 @@ log_write(struct buf *b)
   release(&log.lock);
 }
 
+// Return the id of the transaction that blocks logged now
+// join. Once log.durable reaches it, they are on disk.
+uint
+logtxid(void)
+{
+  uint id;
+
+  acquire(&log.lock);
+  id = log.txid;
+  release(&log.lock);
+  return id;
+}
+
+// Wait until transaction id is in the disk log, copying
+// the in-memory log out if it holds that transaction.
+// Unlike fflush(), returns at once if id is already there.
+void
+logsync(uint id)
+{
+  int n;
+
+  acquire(&log.commitLock);
+  while (1) {
+    acquire(&log.lock);
+    n = log.lh.n;
+    release(&log.lock);
+    // with nothing gathered or being copied, every
+    // transaction so far is on disk.
+    if (log.durable >= id || (n == 0 && !log.copying))
+      break;
+    if (log.copying || log.committing) {
+      // wait for the copy, or for the commit to free the log.
+      sleep(&log, &log.commitLock);
+    } else {
+      log.copying = 1;
+      copy_and_initiate_commit();
+      acquire(&log.commitLock);
+    }
+  }
+  release(&log.commitLock);
+}
+
+// Copy out the log's transaction ids and commit count to
+// the user struct logstat at addr. Returns 0, or -1.
+int
+logstats(uint64 addr)
+{
+  struct logstat st;
+
+  acquire(&log.lock);
+  st.txid = log.txid;
+  st.durable = log.durable;
+  release(&log.lock);
+  st.ncommit = numCommits;
+  return copyout(myproc()->pagetable, addr, (char*)&st, sizeof(st));
+}
+
+static void
+commit_thread(void *arg)
+{
+  // commits must not wait behind CPU-bound processes.
+  setpriority(0, SCHED_RT, 0);
+  commit_loop();
+}
+
+// Start the kernel thread that installs committed blocks.
+// It sleeps until the first commit, so it may start before
+// initlog() has run.
+void
+commitinit(void)
+{
+  initlock(&log.commitLock, "commit");
+  if(kthread_create("commit", commit_thread, 0) == 0)
+    panic("commitinit");
+}
+
 void
 commit_loop()
 {
@@ -314,7 +418,15 @@ commit_loop()
     else {
       debug("Commit worker has nothing to do. Sleeping...\n");
       debug("Sleeping on commit lock\n");
-      sleep(&log, &log.commitLock);
+      // Don't leave blocks in the in-memory log indefinitely
+      // when no one calls fflush() or fills the log: copy
+      // them out after COMMITDELAY, then commit them.
+      if(sleepuntil(&log, &log.commitLock, r_time() + COMMITDELAY) < 0 &&
+         !log.copying && !log.committing && log.lh.n > 0){
+        log.copying = 1;
+        copy_and_initiate_commit();
+        acquire(&log.commitLock);
+      }
     }
   }
 }
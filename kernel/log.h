@@ -14,8 +14,11 @@ struct log {
   int outstanding; // how many FS sys calls are executing.
   int committing;  // In commit, don't allow blocks to be copied to disk
   int copying;     // Don't allow syscalls to execute when the log is being copied to disk
+  int draining;    // A copy waits for outstanding ops to end; begin_op waits for it
   int copyAttempted;    // Dont try to initiate a copy again when a previous thread has already attempted to copy 
   int dev;
+  uint txid;       // id of the transaction gathering in lh
+  uint durable;    // id of the last transaction written to the disk log
   struct logheader lh;
 };
 
@@ -0,0 +1,7 @@
+// State of the file system log, as returned by the logstat()
+// system call. Transaction ids count up from 1.
+struct logstat {
+  uint txid;     // Transaction gathering in memory
+  uint durable;  // Last transaction written to the disk log
+  uint ncommit;  // Transactions installed since boot
+};
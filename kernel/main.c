@@ -20,14 +20,17 @@ main()
     kvminit();       // create kernel page table
     kvminithart();   // turn on paging
     procinit();      // process table
+    futexinit();     // futex lock
     trapinit();      // trap vectors
     trapinithart();  // install kernel trap vector
     plicinit();      // set up interrupt controller
     plicinithart();  // ask PLIC for device interrupts
     binit();         // buffer cache
     iinit();         // inode table
+    pcinit();        // file page cache
     fileinit();      // file table
     virtio_disk_init(); // emulated hard disk
+    commitinit();    // log commit worker thread
     userinit();      // first user process
     __sync_synchronize();
     started = 1;
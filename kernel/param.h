@@ -1,7 +1,7 @@
 #ifndef PARAM_H
 #define PARAM_H
 
-#define NPROC        64  // maximum number of processes
+#define NPROC       256  // maximum number of processes
 #define NCPU          8  // maximum number of CPUs
 #define NOFILE       16  // open files per process
 #define NFILE       100  // open files per system
@@ -14,5 +14,22 @@
 #define NBUF         (MAXOPBLOCKS*3)  // size of disk block cache
 #define FSSIZE       2000  // size of file system in blocks
 #define MAXPATH      128   // maximum file path name
+#define NVMA         16    // demand-paged regions per process
+#define NMEGA        16    // 2MB blocks kept for user megapages
+#define NWAITQ       61    // wait channel hash buckets
+#define NPIDHASH     127   // pid hash buckets
+#define NTHREAD      16    // threads sharing an address space
+#define NSHARED      4     // sleep locks one process may share at once
+#define NPCACHE      128   // pages in the file page cache
+#define NPCMAX       512   // ... counting pages still mapped
+#define NPIPEPAGE    4     // pages of buffer per pipe, a power of two
+#define NLOCKCLASS   48    // lock names with their own statistics
+#define TIMEFREQ     10000000  // r_time() units per second
+#define TICKTIME     (TIMEFREQ/10)  // r_time() units per uptime() tick
+#define NSPERTIME    (1000000000/TIMEFREQ)  // nanoseconds per r_time() unit
+#define QUANTUM      (TIMEFREQ/10)  // default scheduler time slice
+#define MINQUANTUM   (TIMEFREQ/1000)  // shortest time slice setquantum() allows
+#define MIGRATECOST  5000  // r_time() units a process stays cache-hot
+#define COMMITDELAY  (5*TIMEFREQ)  // longest a logged block waits for commit
 
 #endif
\ No newline at end of file
@@ -0,0 +1,292 @@
+// File page cache.
+//
+// Holds whole pages of file contents keyed by (dev, inum, offset),
+// so that a demand-paged program's text is read from disk once and
+// the same physical pages are mapped into every process running it,
+// and so that every MAP_SHARED mapping of a file maps the same pages.
+//
+// A cached page is an ordinary kalloc() page with one reference
+// held by the cache. pcget() hands out further references, which
+// callers drop with kfree(). Only pages that nobody else holds
+// are evicted, so a page stays findable for as long as it is
+// mapped. While more than NPCACHE pages are in use the cache
+// holds up to NPCMAX, and shrinks back as they are unmapped;
+// past NPCMAX, pcget() fails. Invalidating a page only drops
+// the cache's reference.
+//
+// A page of an inode is only filled while holding the inode's
+// lock. writei() copies what it writes into the inode's cached
+// pages and truncation invalidates them, under the same lock, so
+// the cache never holds stale file data. Stores through writable
+// MAP_SHARED mappings make a cached page newer than the disk, so
+// readi() reads such a file through pcread() where it can.
+
+#include "types.h"
+#include "param.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "riscv.h"
+#include "defs.h"
+#include "fs.h"
+#include "file.h"
+
+#define NPCBUCKET 31
+
+struct pcpage {
+  uint dev;
+  uint inum;
+  uint off;              // file offset of the first byte
+  uint64 pa;             // cached page, or 0 if the entry is free
+  struct pcpage *hnext;  // hash chain, keyed by inum
+  struct pcpage *prev;   // LRU list
+  struct pcpage *next;
+};
+
+// least recently used pages looked at for one eviction.
+#define PCSCAN 8
+
+struct {
+  struct spinlock lock;
+  struct pcpage page[NPCMAX];
+  struct pcpage *bucket[NPCBUCKET];
+  struct pcpage *free;   // unused entries, through hnext
+  int n;                 // pages cached
+
+  // Linked list of the cached pages, through prev/next.
+  // Sorted by how recently the page was used.
+  // head.next is most recent, head.prev is least.
+  struct pcpage head;
+} pcache;
+
+void
+pcinit(void)
+{
+  struct pcpage *pg;
+
+  initlock(&pcache.lock, "pcache");
+  pcache.head.prev = &pcache.head;
+  pcache.head.next = &pcache.head;
+  for(pg = pcache.page; pg < pcache.page+NPCMAX; pg++){
+    pg->hnext = pcache.free;
+    pcache.free = pg;
+  }
+}
+
+// Link pg in at the head of the LRU list.
+// Caller must hold pcache.lock.
+static void
+pclink(struct pcpage *pg)
+{
+  pg->next = pcache.head.next;
+  pg->prev = &pcache.head;
+  pg->next->prev = pg;
+  pg->prev->next = pg;
+}
+
+// Move pg to the head of the LRU list.
+// Caller must hold pcache.lock.
+static void
+pcmove(struct pcpage *pg)
+{
+  pg->next->prev = pg->prev;
+  pg->prev->next = pg->next;
+  pclink(pg);
+}
+
+// Caller must hold pcache.lock.
+static struct pcpage*
+pclookup(uint dev, uint inum, uint off)
+{
+  struct pcpage *pg;
+
+  for(pg = pcache.bucket[inum % NPCBUCKET]; pg; pg = pg->hnext)
+    if(pg->dev == dev && pg->inum == inum && pg->off == off)
+      return pg;
+  return 0;
+}
+
+// Remove pg from its hash chain and the LRU list, drop the
+// cache's reference to its page, and free the entry.
+// Caller must hold pcache.lock.
+static void
+pcdrop(struct pcpage *pg)
+{
+  struct pcpage **pp;
+
+  for(pp = &pcache.bucket[pg->inum % NPCBUCKET]; *pp != pg; pp = &(*pp)->hnext)
+    ;
+  *pp = pg->hnext;
+  pg->next->prev = pg->prev;
+  pg->prev->next = pg->next;
+  kfree((void*)pg->pa);
+  pg->pa = 0;
+  pg->hnext = pcache.free;
+  pcache.free = pg;
+  pcache.n--;
+}
+
+// Return an unused entry for a new page. With NPCACHE pages
+// cached, first evict one of the PCSCAN least recently used
+// whose page only the cache holds, so that dropping it unmaps
+// nothing; the mapped ones seen move to the head, so the next
+// scan looks at others. Returns 0 if NPCMAX pages are in use.
+// Caller must hold pcache.lock.
+static struct pcpage*
+pcvictim(void)
+{
+  struct pcpage *pg, *prev;
+  int i;
+
+  if(pcache.n >= NPCACHE){
+    pg = pcache.head.prev;
+    for(i = 0; i < PCSCAN && pg != &pcache.head; i++, pg = prev){
+      prev = pg->prev;
+      if(krefs((void*)pg->pa) == 1){
+        pcdrop(pg);
+        break;
+      }
+      pcmove(pg);
+    }
+  }
+
+  if((pg = pcache.free) == 0)
+    return 0;
+  pcache.free = pg->hnext;
+  return pg;
+}
+
+
+// Return a page holding the contents of ip starting at byte
+// offset off, with a reference for the caller; kfree() drops it.
+// Bytes past the end of the file read as zero.
+// Reads the file on a miss. Returns 0 if out of memory, or if
+// NPCMAX pages are cached and all of them are mapped.
+uint64
+pcget(struct inode *ip, uint off)
+{
+  struct pcpage *pg;
+  uint64 pa;
+  char *mem;
+  int locked;
+
+  acquire(&pcache.lock);
+  if((pg = pclookup(ip->dev, ip->inum, off)) != 0){
+    pa = pg->pa;
+    kdup((void*)pa);
+    pcmove(pg);
+    release(&pcache.lock);
+    return pa;
+  }
+  release(&pcache.lock);
+
+  if((mem = kalloc()) == 0)
+    return 0;
+  memset(mem, 0, PGSIZE);
+
+  // The caller may already hold ip's lock, when the page
+  // fault came from copyout() inside a readi() or writei() of
+  // this file. It must not share it again: a writer waiting
+  // for the lock would hold it back.
+  locked = holdingsleep(&ip->lock) || holdingsleepshared(&ip->lock);
+  if(!locked)
+    ilockshared(ip);
+  readi(ip, 0, (uint64)mem, off, PGSIZE);
+
+  acquire(&pcache.lock);
+  if((pg = pclookup(ip->dev, ip->inum, off)) != 0){
+    // filled by another process while we were reading.
+    kfree(mem);
+    pcmove(pg);
+  } else {
+    if((pg = pcvictim()) == 0){
+      release(&pcache.lock);
+      kfree(mem);
+      if(!locked)
+        iunlockshared(ip);
+      return 0;
+    }
+    pg->dev = ip->dev;
+    pg->inum = ip->inum;
+    pg->off = off;
+    pg->pa = (uint64)mem;
+    pg->hnext = pcache.bucket[ip->inum % NPCBUCKET];
+    pcache.bucket[ip->inum % NPCBUCKET] = pg;
+    pclink(pg);
+    pcache.n++;
+  }
+  pa = pg->pa;
+  kdup((void*)pa);
+  release(&pcache.lock);
+
+  if(!locked)
+    iunlockshared(ip);
+  return pa;
+}
+
+// Copy up to n bytes of ip from offset off, up to the end of
+// its page, to dst if that page is cached. It holds the latest
+// contents, including stores through MAP_SHARED mappings not yet
+// written back. Returns the number of bytes copied, 0 if the page
+// is not cached, or -1. Caller must hold ip->lock.
+int
+pcread(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
+{
+  struct pcpage *pg;
+  uint64 pa;
+
+  acquire(&pcache.lock);
+  if((pg = pclookup(ip->dev, ip->inum, off - off % PGSIZE)) == 0){
+    release(&pcache.lock);
+    return 0;
+  }
+  pa = pg->pa;
+  kdup((void*)pa);
+  release(&pcache.lock);
+
+  // copyout() may fault in a page of this very file, so copy
+  // without pcache.lock, holding a reference instead.
+  if(n > PGSIZE - off % PGSIZE)
+    n = PGSIZE - off % PGSIZE;
+  if(either_copyout(user_dst, dst, (char*)pa + off % PGSIZE, n) < 0)
+    n = -1;
+  kfree((void*)pa);
+  return n;
+}
+
+// Forget all cached pages of ip, because its contents changed.
+// Caller must hold ip->lock.
+void
+pcinval(struct inode *ip)
+{
+  struct pcpage *pg, *next;
+
+  acquire(&pcache.lock);
+  for(pg = pcache.bucket[ip->inum % NPCBUCKET]; pg; pg = next){
+    next = pg->hnext;
+    if(pg->dev == ip->dev && pg->inum == ip->inum)
+      pcdrop(pg);
+  }
+  release(&pcache.lock);
+}
+
+// Copy n bytes at src, just written to ip at offset off, into the
+// cached pages they fall in, so mappings of the file see the write.
+// Caller must hold ip->lock.
+void
+pcwrite(struct inode *ip, uint off, char *src, uint n)
+{
+  struct pcpage *pg;
+  uint lo, hi;
+
+  acquire(&pcache.lock);
+  for(pg = pcache.bucket[ip->inum % NPCBUCKET]; pg; pg = pg->hnext){
+    if(pg->dev != ip->dev || pg->inum != ip->inum)
+      continue;
+    if(pg->off >= off + n || off >= pg->off + PGSIZE)
+      continue;
+    lo = off > pg->off ? off : pg->off;
+    hi = off + n < pg->off + PGSIZE ? off + n : pg->off + PGSIZE;
+    memmove((char*)pg->pa + (lo - pg->off), src + (lo - off), hi - lo);
+  }
+  release(&pcache.lock);
+}
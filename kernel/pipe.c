@@ -8,21 +8,165 @@
 #include "sleeplock.h"
 #include "file.h"
 
-#define PIPESIZE 512
+// The pipe's data is a ring of NPIPEPAGE pages, not necessarily
+// contiguous. NPIPEPAGE must be a power of two, so that nread
+// and nwrite index the ring correctly when they wrap around.
+#define PIPESIZE (NPIPEPAGE*PGSIZE)
 
+// One process at a time writes, holding wlock, and one reads,
+// holding rlock, so the ring has a single producer and a single
+// consumer, which need no lock to share it: the writer only
+// touches bytes from nwrite on and the reader only bytes before
+// it, and each publishes its index with a release store after
+// copying, which the other loads with acquire. lock is taken
+// only to sleep while the pipe is full or empty, and to wake a
+// sleeper, which says it is waiting in wwait or rwait.
+// The writer's and reader's fields are on separate cache lines.
 struct pipe {
   struct spinlock lock;
-  char data[PIPESIZE];
-  uint nread;     // number of bytes read
-  uint nwrite;    // number of bytes written
+  char *data[NPIPEPAGE];
   int readopen;   // read fd is still open
   int writeopen;  // write fd is still open
+
+  struct sleeplock wlock __attribute__((aligned(64)));
+  uint nwrite;    // number of bytes written
+  int wwait;      // writer is waiting for room
+
+  struct sleeplock rlock __attribute__((aligned(64)));
+  uint nread;     // number of bytes read
+  int rwait;      // reader is waiting for data
 };
 
+// Address of the byte at ring offset off, and in *m how many
+// bytes from there to the end of its page, at most max.
+static char*
+pipebuf(struct pipe *pi, uint off, uint *m, uint max)
+{
+  uint o = off % PGSIZE;
+
+  *m = PGSIZE - o < max ? PGSIZE - o : max;
+  return pi->data[(off / PGSIZE) % NPIPEPAGE] + o;
+}
+
+// Wait until the pipe has room, then set *p to where the next
+// byte goes and return how many bytes, at most max, can be
+// written there in one piece. Returns -1 if the read end is
+// closed or the process killed. Caller must hold pi->wlock.
+static int
+pipespace(struct pipe *pi, uint max, char **p)
+{
+  uint m, room;
+
+  if(pi->readopen == 0 || killed(myproc()))
+    return -1;
+  room = __atomic_load_n(&pi->nread, __ATOMIC_ACQUIRE) + PIPESIZE - pi->nwrite;
+  if(room == 0){
+    // full. set wwait before looking again, and the reader
+    // looks at wwait after freeing room, so one of us sees
+    // the other; the reader wakes us with lock held.
+    acquire(&pi->lock);
+    pi->wwait = 1;
+    __sync_synchronize();
+    while(__atomic_load_n(&pi->nread, __ATOMIC_ACQUIRE) + PIPESIZE == pi->nwrite){ //DOC: pipewrite-full
+      if(pi->readopen == 0 || killed(myproc()))
+        break;
+      sleep(&pi->nwrite, &pi->lock);
+    }
+    pi->wwait = 0;
+    release(&pi->lock);
+    if(pi->readopen == 0 || killed(myproc()))
+      return -1;
+    room = __atomic_load_n(&pi->nread, __ATOMIC_ACQUIRE) + PIPESIZE - pi->nwrite;
+  }
+
+  *p = pipebuf(pi, pi->nwrite, &m, max);
+  return m < room ? m : room;
+}
+
+// Pass the m bytes just written at pi->nwrite to the reader,
+// and wake it if it is waiting for them.
+// Caller must hold pi->wlock.
+static void
+pipecommit(struct pipe *pi, uint m)
+{
+  __atomic_store_n(&pi->nwrite, pi->nwrite + m, __ATOMIC_RELEASE);
+  __sync_synchronize();
+  if(pi->rwait){
+    acquire(&pi->lock);
+    wakeup(&pi->nread);
+    release(&pi->lock);
+  }
+}
+
+// Set *p to the byte skip bytes after pi->nread, and return how
+// many bytes, at most max, can be read there in one piece. If
+// there are none, wait for more if wait is set, and return 0 if
+// the write end is closed; or -1 if the process is killed.
+// Caller must hold pi->rlock.
+static int
+pipedata(struct pipe *pi, uint skip, uint max, char **p, int wait)
+{
+  uint m, avail;
+
+  avail = __atomic_load_n(&pi->nwrite, __ATOMIC_ACQUIRE) - pi->nread;
+  if(avail <= skip && wait){
+    // empty. as in pipespace(), with the roles swapped.
+    // pipeclose() clears writeopen with lock held, after the
+    // writer's last pipecommit(), so nwrite is looked at again
+    // once writeopen is seen to be clear.
+    acquire(&pi->lock);
+    pi->rwait = 1;
+    __sync_synchronize();
+    while(__atomic_load_n(&pi->nwrite, __ATOMIC_ACQUIRE) - pi->nread <= skip &&
+          pi->writeopen){  //DOC: pipe-empty
+      if(killed(myproc())){
+        pi->rwait = 0;
+        release(&pi->lock);
+        return -1;
+      }
+      sleep(&pi->nread, &pi->lock); //DOC: piperead-sleep
+    }
+    pi->rwait = 0;
+    release(&pi->lock);
+    avail = __atomic_load_n(&pi->nwrite, __ATOMIC_ACQUIRE) - pi->nread;
+  }
+  if(avail <= skip)
+    return 0;
+
+  *p = pipebuf(pi, pi->nread + skip, &m, max);
+  return m < avail - skip ? m : avail - skip;
+}
+
+// Free the m bytes at pi->nread for the writer, and wake
+// it if it is waiting for room. Caller must hold pi->rlock.
+static void
+pipeconsume(struct pipe *pi, uint m)
+{
+  __atomic_store_n(&pi->nread, pi->nread + m, __ATOMIC_RELEASE);
+  __sync_synchronize();
+  if(pi->wwait){
+    acquire(&pi->lock);
+    wakeup(&pi->nwrite);  //DOC: piperead-wakeup
+    release(&pi->lock);
+  }
+}
+
+static void
+pipefree(struct pipe *pi)
+{
+  int i;
+
+  for(i = 0; i < NPIPEPAGE; i++)
+    if(pi->data[i])
+      kfree(pi->data[i]);
+  kfree((char*)pi);
+}
+
 int
 pipealloc(struct file **f0, struct file **f1)
 {
   struct pipe *pi;
+  int i;
 
   pi = 0;
   *f0 = *f1 = 0;
@@ -30,11 +174,17 @@ pipealloc(struct file **f0, struct file **f1)
     goto bad;
   if((pi = (struct pipe*)kalloc()) == 0)
     goto bad;
+  memset(pi, 0, sizeof(*pi));
+  for(i = 0; i < NPIPEPAGE; i++)
+    if((pi->data[i] = kalloc()) == 0)
+      goto bad;
   pi->readopen = 1;
   pi->writeopen = 1;
   pi->nwrite = 0;
   pi->nread = 0;
   initlock(&pi->lock, "pipe");
+  initsleeplock(&pi->wlock, "pipew");
+  initsleeplock(&pi->rlock, "piper");
   (*f0)->type = FD_PIPE;
   (*f0)->readable = 1;
   (*f0)->writable = 0;
@@ -47,7 +197,7 @@ pipealloc(struct file **f0, struct file **f1)
 
  bad:
   if(pi)
-    kfree((char*)pi);
+    pipefree(pi);
   if(*f0)
     fileclose(*f0);
   if(*f1)
@@ -68,63 +218,157 @@ pipeclose(struct pipe *pi, int writable)
   }
   if(pi->readopen == 0 && pi->writeopen == 0){
     release(&pi->lock);
-    kfree((char*)pi);
+    pipefree(pi);
   } else
     release(&pi->lock);
 }
 
+// Copy the n bytes at user address addr into the pipe, a
+// page-contiguous piece at a time, sleeping while it is full.
 int
 pipewrite(struct pipe *pi, uint64 addr, int n)
 {
-  int i = 0;
+  int i = 0, m;
+  char *p;
   struct proc *pr = myproc();
 
-  acquire(&pi->lock);
+  acquiresleep(&pi->wlock);
   while(i < n){
-    if(pi->readopen == 0 || killed(pr)){
-      release(&pi->lock);
+    if((m = pipespace(pi, n - i, &p)) < 0){
+      releasesleep(&pi->wlock);
       return -1;
     }
-    if(pi->nwrite == pi->nread + PIPESIZE){ //DOC: pipewrite-full
-      wakeup(&pi->nread);
-      sleep(&pi->nwrite, &pi->lock);
-    } else {
-      char ch;
-      if(copyin(pr->pagetable, &ch, addr + i, 1) == -1)
-        break;
-      pi->data[pi->nwrite++ % PIPESIZE] = ch;
-      i++;
-    }
+    if(copyin(pr->pagetable, p, addr + i, m) == -1)
+      break;
+    pipecommit(pi, m);
+    i += m;
   }
-  wakeup(&pi->nread);
-  release(&pi->lock);
+  releasesleep(&pi->wlock);
 
   return i;
 }
 
+// Copy up to n bytes out of the pipe to user address addr,
+// a page-contiguous piece at a time, sleeping while it is
+// empty.
 int
 piperead(struct pipe *pi, uint64 addr, int n)
 {
-  int i;
+  int i = 0, m;
+  char *p;
   struct proc *pr = myproc();
-  char ch;
 
-  acquire(&pi->lock);
-  while(pi->nread == pi->nwrite && pi->writeopen){  //DOC: pipe-empty
-    if(killed(pr)){
-      release(&pi->lock);
+  acquiresleep(&pi->rlock);
+  while(i < n){  //DOC: piperead-copy
+    if((m = pipedata(pi, 0, n - i, &p, i == 0)) <= 0){
+      if(m < 0)
+        i = -1;
+      break;
+    }
+    if(copyout(pr->pagetable, addr + i, p, m) == -1)
+      break;
+    pipeconsume(pi, m);
+    i += m;
+  }
+  releasesleep(&pi->rlock);
+  return i;
+}
+
+// splice() from inode ip at *off into pi: read up to n bytes
+// straight into the pipe's ring, stopping at the end of the file.
+// Returns the number of bytes moved, or -1.
+int
+pipefromi(struct pipe *pi, struct inode *ip, uint *off, int n)
+{
+  int i = 0, m, r;
+  char *p;
+
+  acquiresleep(&pi->wlock);
+  while(i < n){
+    if((m = pipespace(pi, n - i, &p)) < 0){
+      releasesleep(&pi->wlock);
       return -1;
     }
-    sleep(&pi->nread, &pi->lock); //DOC: piperead-sleep
+    ilockshared(ip);
+    if((r = readi(ip, 0, (uint64)p, *off, m)) > 0)
+      *off += r;
+    iunlockshared(ip);
+    if(r <= 0)
+      break;
+    pipecommit(pi, r);
+    i += r;
+    if(r < m)
+      break;
   }
-  for(i = 0; i < n; i++){  //DOC: piperead-copy
-    if(pi->nread == pi->nwrite)
+  releasesleep(&pi->wlock);
+  return i;
+}
+
+// splice() from pi to inode ip at *off: write up to n bytes
+// straight from the pipe's ring, in transactions of at most
+// a few blocks, as filewrite() does.
+// Returns the number of bytes moved, or -1.
+int
+pipetoi(struct pipe *pi, struct inode *ip, uint *off, int n)
+{
+  int max = MAXOPBYTES;
+  int i = 0, m, r;
+  char *p;
+
+  acquiresleep(&pi->rlock);
+  while(i < n){
+    if((m = pipedata(pi, 0, n - i < max ? n - i : max, &p, i == 0)) <= 0){
+      if(m < 0)
+        i = -1;
       break;
-    ch = pi->data[pi->nread++ % PIPESIZE];
-    if(copyout(pr->pagetable, addr + i, &ch, 1) == -1)
+    }
+    begin_op();
+    ilock(ip);
+    if((r = writei(ip, 0, (uint64)p, *off, m)) > 0)
+      *off += r;
+    iunlock(ip);
+    end_op();
+    if(r > 0){
+      pipeconsume(pi, r);
+      i += r;
+    }
+    if(r != m)
       break;
   }
-  wakeup(&pi->nwrite);  //DOC: piperead-wakeup
-  release(&pi->lock);
+  releasesleep(&pi->rlock);
+  return i;
+}
+
+// splice() between pipes: move up to n bytes from src to dst,
+// or with keep, as tee() does, copy them and leave them in src.
+// Returns the number of bytes moved, or -1.
+int
+pipetopipe(struct pipe *src, struct pipe *dst, int n, int keep)
+{
+  int i = 0, m;
+  char *s, *d;
+
+  if(src == dst)
+    return -1;
+  acquiresleep(&src->rlock);
+  acquiresleep(&dst->wlock);
+  while(i < n){
+    if((m = pipedata(src, keep ? i : 0, n - i, &s, i == 0)) <= 0){
+      if(m < 0)
+        i = -1;
+      break;
+    }
+    if((m = pipespace(dst, m, &d)) < 0){
+      i = -1;
+      break;
+    }
+    memmove(d, s, m);
+    pipecommit(dst, m);
+    if(!keep)
+      pipeconsume(src, m);
+    i += m;
+  }
+  releasesleep(&dst->wlock);
+  releasesleep(&src->rlock);
   return i;
 }
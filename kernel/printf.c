@@ -49,6 +49,22 @@ printint(int xx, int base, int sign)
     consputc(buf[i]);
 }
 
+// print an unsigned 64-bit number; printint() only takes an int.
+static void
+printlong(uint64 x, int base)
+{
+  char buf[24];
+  int i;
+
+  i = 0;
+  do {
+    buf[i++] = digits[x % base];
+  } while((x /= base) != 0);
+
+  while(--i >= 0)
+    consputc(buf[i]);
+}
+
 static void
 printptr(uint64 x)
 {
@@ -59,7 +75,8 @@ printptr(uint64 x)
     consputc(digits[x >> (sizeof(uint64) * 8 - 4)]);
 }
 
-// Print to the console. only understands %d, %x, %p, %s.
+// Print to the console. only understands %d, %l, %x, %p, %s.
+// %l is an unsigned 64-bit number, in decimal.
 void
 printf(char *fmt, ...)
 {
@@ -87,6 +104,9 @@ printf(char *fmt, ...)
     case 'd':
       printint(va_arg(ap, int), 10, 1);
       break;
+    case 'l':
+      printlong(va_arg(ap, uint64), 10);
+      break;
     case 'x':
       printint(va_arg(ap, int), 16, 1);
       break;
@@ -4,19 +4,103 @@
 #include "riscv.h"
 #include "spinlock.h"
 #include "proc.h"
+#include "sched.h"
 #include "defs.h"
 
 struct cpu cpus[NCPU];
 
-struct proc proc[NPROC];
+// Process structures are allocated on demand, a page each,
+// along with a kernel stack page. They are never returned to
+// kalloc(): freeproc() puts them on a free list for the next
+// allocproc(). So a stale pointer to a proc, such as one left in
+// a wait or timer queue, always points at a proc, whose state
+// and pid say whether it is still the one the pointer was for.
+// The cost is that the most procs ever in use keep their two
+// pages each for good, so NPROC bounds that: 256 procs pin 2MB.
+// Lock order: p->lock, then ptable.lock.
+struct {
+  struct spinlock lock;
+  struct proc *pidhash[NPIDHASH];  // procs in use, by pid
+  struct proc *free;               // UNUSED procs
+  struct proc *all;                // all procs, for procdump()
+  int n;                           // procs in use
+  int nextpid;
+  int nstack;                      // KSTACK slots handed out
+} ptable;
 
 struct proc *initproc;
 
-int nextpid = 1;
-struct spinlock pid_lock;
+// CPUs that have entered scheduler().
+uint64 cpuonline;
+
+// How long a process runs before yielding to others queued
+// for its CPU, in r_time() units. See timerarm().
+uint64 quantum = QUANTUM;
+
+// Per-CPU queues of RUNNABLE processes. setrunnable() puts a
+// process on the queue of the CPU it last ran on, where its
+// cache and TLB contents may still be warm, and the scheduler()
+// that takes it off runs it. A CPU whose queue is empty steals
+// from the others, but leaves alone processes that ran within
+// MIGRATECOST unless their queue has a backlog. A process only
+// ever runs on the CPUs in its affinity mask.
+// Lock order: p->lock, then a queue's lock.
+//
+// SCHED_RT processes run first, round-robin. SCHED_FAIR ones
+// run in order of vruntime, the CPU time they have used divided
+// by their nice weight, so each gets a share of the CPU in
+// proportion to its weight.
+struct runq {
+  struct spinlock lock;
+  struct proc *rt;       // SCHED_RT, FIFO, linked through p->rqnext
+  struct proc *rttail;
+  struct proc *fair;     // SCHED_FAIR, sorted by vruntime
+  uint64 minvruntime;    // vruntime of the last SCHED_FAIR pick
+  int n;
+} runq[NCPU];
+
+// SCHED_FAIR weight of each nice value, from NICE_MIN up;
+// each step is about 1.25 times the next.
+static const int niceweight[NICE_MAX - NICE_MIN + 1] = {
+  88761, 71755, 56483, 46273, 36291,
+  29154, 23254, 18705, 14949, 11916,
+  9548, 7620, 6100, 4904, 3906,
+  3121, 2501, 1991, 1586, 1277,
+  1024, 820, 655, 526, 423,
+  335, 272, 215, 172, 137,
+  110, 87, 70, 56, 45,
+  36, 29, 23, 18, 15,
+};
+
+// Sleeping processes, hashed by wait channel, so that wakeup()
+// looks only at processes that may be sleeping on its channel.
+// A process adds itself in sleep() and removes itself once it
+// wakes up. Lock order: lk passed to sleep(), then a wait
+// queue's lock, then p->lock.
+struct waitq {
+  struct spinlock lock;
+  struct proc *head;     // linked through p->wqnext
+} waitq[NWAITQ];
+
+#define WAITQ(chan) (&waitq[((uint64)(chan) >> 3) % NWAITQ])
+
+// Per-CPU min-heaps of processes in sleepuntil(), ordered by
+// deadline. A process joins the heap of the CPU it goes to
+// sleep on, whose timerarm() sets the timer for the earliest
+// deadline, and leaves once it is awake; timerexpire() wakes
+// only the processes whose deadlines have passed.
+// Lock order: p->lock, then a timer heap's lock.
+struct timerq {
+  struct spinlock lock;
+  int n;
+  struct proc *heap[NPROC];   // heap[0] has the earliest deadline
+} timerq[NCPU];
+
 
 extern void forkret(void);
+static void kthreadstart(void);
 static void freeproc(struct proc *p);
+static void tgdrop(struct proc *p);
 
 extern char trampoline[]; // trampoline.S
 extern int numCommits;
@@ -26,36 +110,22 @@ extern int numCommits;
 // must be acquired before any p->lock.
 struct spinlock wait_lock;
 
-// Allocate a page for each process's kernel stack.
-// Map it high in memory, followed by an invalid
-// guard page.
-void
-proc_mapstacks(pagetable_t kpgtbl)
-{
-  struct proc *p;
-  
-  for(p = proc; p < &proc[NPROC]; p++) {
-    char *pa = kalloc();
-    if(pa == 0)
-      panic("kalloc");
-    uint64 va = KSTACK((int) (p - proc));
-    kvmmap(kpgtbl, va, (uint64)pa, PGSIZE, PTE_R | PTE_W);
-  }
-}
-
 // initialize the proc table.
 void
 procinit(void)
 {
-  struct proc *p;
-  
-  initlock(&pid_lock, "nextpid");
+  if(sizeof(struct proc) > PGSIZE)
+    panic("procinit: struct proc");
+
+  initlock(&ptable.lock, "ptable");
+  ptable.nextpid = 1;
   initlock(&wait_lock, "wait_lock");
-  for(p = proc; p < &proc[NPROC]; p++) {
-      initlock(&p->lock, "proc");
-      p->state = UNUSED;
-      p->kstack = KSTACK((int) (p - proc));
-  }
+  for(int i = 0; i < NCPU; i++)
+    initlock(&runq[i].lock, "runq");
+  for(int i = 0; i < NWAITQ; i++)
+    initlock(&waitq[i].lock, "waitq");
+  for(int i = 0; i < NCPU; i++)
+    initlock(&timerq[i].lock, "timerq");
 }
 
 // Must be called with interrupts disabled,
@@ -89,41 +159,111 @@ myproc(void)
   return p;
 }
 
-int
-allocpid()
+// Allocate and initialize a new UNUSED proc and its kernel
+// stack. Returns 0 if out of memory.
+// The stack is mapped at the next KSTACK slot, above a guard
+// page. Procs are never freed, so there are at most NPROC slots.
+static struct proc*
+procnew(void)
 {
-  int pid;
-  
-  acquire(&pid_lock);
-  pid = nextpid;
-  nextpid = nextpid + 1;
-  release(&pid_lock);
+  struct proc *p;
+  char *stack;
 
-  return pid;
+  if((p = (struct proc*)kalloc()) == 0)
+    return 0;
+  memset(p, 0, sizeof(*p));
+  if((stack = kalloc()) == 0){
+    kfree(p);
+    return 0;
+  }
+  initlock(&p->lock, "proc");
+  p->tq = -1;
+  p->state = UNUSED;
+
+  acquire(&ptable.lock);
+  p->kstack = KSTACK(ptable.nstack);
+  if(kvmmapstack(p->kstack, (uint64)stack) != 0){
+    release(&ptable.lock);
+    kfree(stack);
+    kfree(p);
+    return 0;
+  }
+  ptable.nstack++;
+  p->allnext = ptable.all;
+  ptable.all = p;
+  release(&ptable.lock);
+  return p;
+}
+
+// Return the proc with the given pid, with its lock held,
+// or 0 if there is none.
+static struct proc*
+pidlookup(int pid)
+{
+  struct proc *p;
+
+  acquire(&ptable.lock);
+  for(p = ptable.pidhash[pid % NPIDHASH]; p; p = p->pidnext)
+    if(p->pid == pid)
+      break;
+  release(&ptable.lock);
+  if(p == 0)
+    return 0;
+
+  acquire(&p->lock);
+  if(p->pid != pid){
+    // freed since we looked.
+    release(&p->lock);
+    return 0;
+  }
+  return p;
 }
 
-// Look in the process table for an UNUSED proc.
+// Take an UNUSED proc from the free list, or allocate a new one.
 // If found, initialize state required to run in the kernel,
-// and return with p->lock held.
-// If there are no free procs, or a memory allocation fails, return 0.
+// and return with p->lock held. A user proc also gets a trapframe,
+// and starts at forkret; fork() or clone() then gives it a thread
+// group. Otherwise it is a kernel thread and starts at kthreadstart.
+// If there are NPROC procs already, or a memory allocation
+// fails, return 0.
 static struct proc*
-allocproc(void)
+allocproc(int user)
 {
   struct proc *p;
 
-  for(p = proc; p < &proc[NPROC]; p++) {
-    acquire(&p->lock);
-    if(p->state == UNUSED) {
-      goto found;
-    } else {
-      release(&p->lock);
-    }
+  acquire(&ptable.lock);
+  if(ptable.n >= NPROC){
+    release(&ptable.lock);
+    return 0;
+  }
+  ptable.n++;
+  if((p = ptable.free) != 0)
+    ptable.free = p->pidnext;
+  release(&ptable.lock);
+
+  if(p == 0 && (p = procnew()) == 0){
+    acquire(&ptable.lock);
+    ptable.n--;
+    release(&ptable.lock);
+    return 0;
   }
-  return 0;
 
-found:
-  p->pid = allocpid();
+  acquire(&p->lock);
+  acquire(&ptable.lock);
+  p->pid = ptable.nextpid++;
+  p->pidnext = ptable.pidhash[p->pid % NPIDHASH];
+  ptable.pidhash[p->pid % NPIDHASH] = p;
+  release(&ptable.lock);
   p->state = USED;
+  p->affinity = (1L << NCPU) - 1;
+  p->lastcpu = -1;
+
+  if(!user){
+    memset(&p->context, 0, sizeof(p->context));
+    p->context.ra = (uint64)kthreadstart;
+    p->context.sp = p->kstack + PGSIZE;
+    return p;
+  }
 
   // Allocate a trapframe page.
   if((p->trapframe = (struct trapframe *)kalloc()) == 0){
@@ -131,14 +271,7 @@ found:
     release(&p->lock);
     return 0;
   }
-
-  // An empty user page table.
-  p->pagetable = proc_pagetable(p);
-  if(p->pagetable == 0){
-    freeproc(p);
-    release(&p->lock);
-    return 0;
-  }
+  p->tslot = 0;
 
   // Set up new context to start executing at forkret,
   // which returns to user space.
@@ -150,29 +283,149 @@ found:
 }
 
 // free a proc structure and the data hanging from it,
-// including user pages.
+// including user pages, and put it on the free list.
 // p->lock must be held.
 static void
 freeproc(struct proc *p)
 {
+  struct proc **pp;
+
+  if(p->tg)
+    tgdrop(p);
+  p->tg = 0;
+  p->pagetable = 0;
   if(p->trapframe)
     kfree((void*)p->trapframe);
   p->trapframe = 0;
-  if(p->pagetable)
-    proc_freepagetable(p->pagetable, p->sz);
-  p->pagetable = 0;
-  p->sz = 0;
-  p->pid = 0;
   p->parent = 0;
+  p->children = 0;
+  p->sibling = 0;
   p->name[0] = 0;
   p->chan = 0;
   p->killed = 0;
   p->xstate = 0;
+  p->class = SCHED_FAIR;
+  p->nice = 0;
+  p->vruntime = 0;
+  p->kfn = 0;
+  p->karg = 0;
   p->state = UNUSED;
+
+  acquire(&ptable.lock);
+  for(pp = &ptable.pidhash[p->pid % NPIDHASH]; *pp != p; pp = &(*pp)->pidnext)
+    ;
+  *pp = p->pidnext;
+  p->pid = 0;
+  p->pidnext = ptable.free;
+  ptable.free = p;
+  ptable.n--;
+  release(&ptable.lock);
+}
+
+// Give p, fresh from allocproc(), a new thread group of which
+// it is the only thread, with an empty user page table.
+// Returns 0, or -1 if out of memory.
+static int
+tgnew(struct proc *p)
+{
+  struct tgroup *tg;
+
+  if((tg = (struct tgroup*)kalloc()) == 0)
+    return -1;
+  memset(tg, 0, sizeof(*tg));
+  if((p->pagetable = proc_pagetable(p)) == 0){
+    kfree((void*)tg);
+    return -1;
+  }
+  initlock(&tg->lock, "tgroup");
+  initlock(&tg->pglock, "tgpage");
+  tg->ref = 1;
+  tg->nlive = 1;
+  tg->slots = 1L << p->tslot;
+  p->tg = tg;
+  return 0;
+}
+
+// Drop p's reference to its thread group and unmap p's
+// trapframe from the group's page table. The last reference
+// frees the page table, with the user memory, and the group.
+// Lock order: p->lock, then tg->lock.
+static void
+tgdrop(struct proc *p)
+{
+  struct tgroup *tg = p->tg;
+  int last;
+
+  acquire(&tg->lock);
+  if(tg->slots & (1L << p->tslot)){
+    uvmunmap(p->pagetable, THREADFRAME(p->tslot), 1, 0);
+    tg->slots &= ~(1L << p->tslot);
+  }
+  last = --tg->ref == 0;
+  release(&tg->lock);
+
+  if(last){
+    proc_freepagetable(p->pagetable, tg->sz);
+    kfree((void*)tg);
+  }
+}
+
+// Stop the threads of tg from running in user mode, so that
+// memory can be unmapped without their CPUs holding stale TLB
+// entries for it: interrupt each CPU that is in user mode in
+// one of them, and wait for it to trap into the kernel.
+// Threads in the kernel carry on, but wait in usertrapret()
+// until tgresume(). Must be called without tg->lock.
+void
+tgpause(struct tgroup *tg)
+{
+  struct cpu *c;
+  int busy;
+
+  acquire(&tg->lock);
+  tg->pause++;
+  __sync_synchronize();
+  do {
+    busy = 0;
+    for(c = cpus; c < &cpus[NCPU]; c++){
+      if(c->inuser == tg){
+        busy = 1;
+        ipi(c - cpus);
+      }
+    }
+    // let the interrupts arrive.
+    release(&tg->lock);
+    acquire(&tg->lock);
+  } while(busy);
+  release(&tg->lock);
+}
+
+// Let tg's threads return to user mode again.
+void
+tgresume(struct tgroup *tg)
+{
+  acquire(&tg->lock);
+  if(--tg->pause == 0)
+    wakeup(&tg->pause);
+  release(&tg->lock);
+}
+
+// Return a new reference to the current directory
+// of the current process.
+struct inode*
+cwdget(void)
+{
+  struct tgroup *tg = myproc()->tg;
+  struct inode *ip;
+
+  acquire(&tg->lock);
+  ip = idup(tg->cwd);
+  release(&tg->lock);
+  return ip;
 }
 
 // Create a user page table for a given process, with no user memory,
-// but with trampoline and trapframe pages.
+// but with the trampoline page, and the trapframe at THREADFRAME(p->tslot).
 pagetable_t
 proc_pagetable(struct proc *p)
 {
@@ -193,9 +446,9 @@ proc_pagetable(struct proc *p)
     return 0;
   }
 
-  // map the trapframe page just below the trampoline page, for
+  // map the trapframe page below the trampoline page, for
   // trampoline.S.
-  if(mappages(pagetable, TRAPFRAME, PGSIZE,
+  if(mappages(pagetable, THREADFRAME(p->tslot), PGSIZE,
               (uint64)(p->trapframe), PTE_R | PTE_W) < 0){
     uvmunmap(pagetable, TRAMPOLINE, 1, 0);
     uvmfree(pagetable, 0);
@@ -206,12 +459,16 @@ proc_pagetable(struct proc *p)
 }
 
 // Free a process's page table, and free the
-// physical memory it refers to.
+// physical memory it refers to. The trapframes
+// mapped in it belong to their procs.
 void
 proc_freepagetable(pagetable_t pagetable, uint64 sz)
 {
+  int i;
+
   uvmunmap(pagetable, TRAMPOLINE, 1, 0);
-  uvmunmap(pagetable, TRAPFRAME, 1, 0);
+  for(i = 0; i < NTHREAD; i++)
+    uvmunmap(pagetable, THREADFRAME(i), 1, 0);
   uvmfree(pagetable, sz);
 }
 
@@ -234,44 +491,65 @@ userinit(void)
 {
   struct proc *p;
 
-  p = allocproc();
+  p = allocproc(1);
+  if(p == 0 || tgnew(p) < 0)
+    panic("userinit");
   initproc = p;
   
   // allocate one user page and copy initcode's instructions
   // and data into it.
   uvmfirst(p->pagetable, initcode, sizeof(initcode));
-  p->sz = PGSIZE;
+  p->tg->sz = PGSIZE;
 
   // prepare for the very first "return" from kernel to user.
   p->trapframe->epc = 0;      // user program counter
   p->trapframe->sp = PGSIZE;  // user stack pointer
 
   safestrcpy(p->name, "initcode", sizeof(p->name));
-  p->cwd = namei("/");
+  p->tg->cwd = namei("/");
 
-  p->state = RUNNABLE;
+  setrunnable(p);
 
   release(&p->lock);
 }
 
 // Grow or shrink user memory by n bytes.
-// Return 0 on success, -1 on failure.
-int
+// Return the old size, or -1 on failure.
+uint64
 growproc(int n)
 {
-  uint64 sz;
+  uint64 sz, newsz;
   struct proc *p = myproc();
+  struct tgroup *tg = p->tg;
+
+  if(n < 0){
+    // the other threads may be using the pages.
+    tgpause(tg);
+    acquire(&tg->lock);
+    sz = newsz = tg->sz;
+    if(sz + n < sz)
+      newsz = tg->sz = sz + n;
+    release(&tg->lock);
+    // threads in the kernel may be copying to the pages.
+    if(PGROUNDUP(newsz) < PGROUNDUP(sz))
+      uvmunmapshared(p->pagetable, PGROUNDUP(newsz),
+                     (PGROUNDUP(sz) - PGROUNDUP(newsz)) / PGSIZE, &tg->pglock);
+    tgresume(tg);
+    return sz;
+  }
 
-  sz = p->sz;
-  if(n > 0){
-    if((sz = uvmalloc(p->pagetable, sz, sz + n, PTE_W)) == 0) {
-      return -1;
-    }
-  } else if(n < 0){
-    sz = uvmdealloc(p->pagetable, sz, sz + n);
+  acquire(&tg->lock);
+  sz = tg->sz;
+  // Only move the break; usertrap() maps a zeroed page
+  // the first time each new page is touched.
+  if(sz + n < sz || sz + n > USERTOP ||
+     mmapoverlap(tg->vma, PGROUNDUP(sz), sz + n)){
+    release(&tg->lock);
+    return -1;
   }
-  p->sz = sz;
-  return 0;
+  tg->sz = sz + n;
+  release(&tg->lock);
+  return sz;
 }
 
 // Create a new process, copying the parent.
@@ -282,19 +560,37 @@ fork(void)
   int i, pid;
   struct proc *np;
   struct proc *p = myproc();
+  struct tgroup *tg = p->tg;
 
   // Allocate process.
-  if((np = allocproc()) == 0){
+  if((np = allocproc(1)) == 0){
+    return -1;
+  }
+  if(tgnew(np) < 0){
+    freeproc(np);
+    release(&np->lock);
     return -1;
   }
 
-  // Copy user memory from parent to child.
-  if(uvmcopy(p->pagetable, np->pagetable, p->sz) < 0){
+  // Copy user memory from parent to child, and the
+  // file descriptors, as the parent's other threads
+  // leave them.
+  acquire(&tg->lock);
+  np->tg->sz = tg->sz;
+  if(uvmcopy(p->pagetable, np->pagetable, tg->sz) < 0 ||
+     vmacopy(p->pagetable, np->pagetable, np->tg->vma, tg->vma) < 0){
+    release(&tg->lock);
     freeproc(np);
     release(&np->lock);
     return -1;
   }
-  np->sz = p->sz;
+
+  // increment reference counts on open file descriptors.
+  for(i = 0; i < NOFILE; i++)
+    if(tg->ofile[i])
+      np->tg->ofile[i] = filedup(tg->ofile[i]);
+  np->tg->cwd = idup(tg->cwd);
+  release(&tg->lock);
 
   // copy saved user registers.
   *(np->trapframe) = *(p->trapframe);
@@ -302,24 +598,91 @@ fork(void)
   // Cause fork to return 0 in the child.
   np->trapframe->a0 = 0;
 
-  // increment reference counts on open file descriptors.
-  for(i = 0; i < NOFILE; i++)
-    if(p->ofile[i])
-      np->ofile[i] = filedup(p->ofile[i]);
-  np->cwd = idup(p->cwd);
+  safestrcpy(np->name, p->name, sizeof(p->name));
+
+  np->class = p->class;
+  np->nice = p->nice;
+  np->vruntime = p->vruntime;
+  np->affinity = p->affinity;
+
+  pid = np->pid;
+
+  release(&np->lock);
+
+  acquire(&wait_lock);
+  np->parent = p;
+  np->sibling = p->children;
+  p->children = np;
+  release(&wait_lock);
+
+  acquire(&np->lock);
+  setrunnable(np);
+  release(&np->lock);
+
+  return pid;
+}
+
+// Create a thread of the current process that shares its
+// memory, open files, and current directory, and starts in
+// user space at fn(arg), with stack pointer stack. The thread
+// is a child of its creator, which collects it with wait().
+// Returns the new thread's pid, or -1.
+int
+clone(uint64 fn, uint64 arg, uint64 stack)
+{
+  int slot, pid;
+  struct proc *np;
+  struct proc *p = myproc();
+  struct tgroup *tg = p->tg;
+
+  if((np = allocproc(1)) == 0)
+    return -1;
+
+  // Map the new thread's trapframe in a free slot.
+  acquire(&tg->lock);
+  for(slot = 0; slot < NTHREAD; slot++)
+    if((tg->slots & (1L << slot)) == 0)
+      break;
+  if(slot == NTHREAD ||
+     mappages(p->pagetable, THREADFRAME(slot), PGSIZE,
+              (uint64)np->trapframe, PTE_R | PTE_W) != 0){
+    release(&tg->lock);
+    freeproc(np);
+    release(&np->lock);
+    return -1;
+  }
+  tg->slots |= 1L << slot;
+  tg->ref++;
+  tg->nlive++;
+  release(&tg->lock);
+  np->tg = tg;
+  np->pagetable = p->pagetable;
+  np->tslot = slot;
+
+  *(np->trapframe) = *(p->trapframe);
+  np->trapframe->epc = fn;
+  np->trapframe->a0 = arg;
+  np->trapframe->sp = stack;
 
   safestrcpy(np->name, p->name, sizeof(p->name));
 
+  np->class = p->class;
+  np->nice = p->nice;
+  np->vruntime = p->vruntime;
+  np->affinity = p->affinity;
+
   pid = np->pid;
 
   release(&np->lock);
 
   acquire(&wait_lock);
   np->parent = p;
+  np->sibling = p->children;
+  p->children = np;
   release(&wait_lock);
 
   acquire(&np->lock);
-  np->state = RUNNABLE;
+  setrunnable(np);
   release(&np->lock);
 
   return pid;
@@ -332,41 +695,57 @@ reparent(struct proc *p)
 {
   struct proc *pp;
 
-  for(pp = proc; pp < &proc[NPROC]; pp++){
-    if(pp->parent == p){
-      pp->parent = initproc;
-      wakeup(initproc);
-    }
+  if(p->children == 0)
+    return;
+  for(pp = p->children; ; pp = pp->sibling){
+    pp->parent = initproc;
+    if(pp->sibling == 0)
+      break;
   }
+  pp->sibling = initproc->children;
+  initproc->children = p->children;
+  p->children = 0;
+  wakeup(initproc);
 }
 
-// Exit the current process.  Does not return.
-// An exited process remains in the zombie state
-// until its parent calls wait().
+// Exit the current thread.  Does not return.
+// An exited thread remains in the zombie state
+// until its parent calls wait(). The last thread of
+// a process to exit closes the files and releases the
+// memory regions its threads shared.
 void
 exit(int status)
 {
   struct proc *p = myproc();
+  struct tgroup *tg = p->tg;
+  int last;
 
   if(p == initproc)
     panic("init exiting");
 
-  // Close all open files.
-  for(int fd = 0; fd < NOFILE; fd++){
-    if(p->ofile[fd]){
-      struct file *f = p->ofile[fd];
-      fileclose(f);
-      p->ofile[fd] = 0;
-    }
-  }
+  acquire(&tg->lock);
+  last = --tg->nlive == 0;
+  release(&tg->lock);
+
+  if(last){
+    // Write back and unmap mmap() regions.
+    mmapclose(p->pagetable, tg->vma);
 
-  // Flush the in memory buffers at exit
-  fflush();
+    // Close all open files.
+    for(int fd = 0; fd < NOFILE; fd++){
+      if(tg->ofile[fd]){
+        struct file *f = tg->ofile[fd];
+        fileclose(f);
+        tg->ofile[fd] = 0;
+      }
+    }
 
-  begin_op();
-  iput(p->cwd);
-  end_op();
-  p->cwd = 0;
+    begin_op();
+    iput(tg->cwd);
+    vmafree(tg->vma);
+    end_op();
+    tg->cwd = 0;
+  }
 
   acquire(&wait_lock);
 
@@ -388,42 +767,48 @@ exit(int status)
   panic("zombie exit");
 }
 
-// Wait for a child process to exit and return its pid.
-// Return -1 if this process has no children.
+// Wait for a child process or thread to exit and return its
+// pid; only for the child with the given pid, unless it is -1.
+// Return -1 if this process has no such children.
 int
-wait(uint64 addr)
+wait(int pid, uint64 addr)
 {
-  struct proc *pp;
-  int havekids, pid;
+  struct proc *pp, **cp;
+  int havekids;
   struct proc *p = myproc();
 
+  if(addr != 0)
+    vmaprefault(addr, sizeof(pp->xstate));
+
   acquire(&wait_lock);
 
   for(;;){
-    // Scan through table looking for exited children.
+    // Scan through our children looking for exited ones.
     havekids = 0;
-    for(pp = proc; pp < &proc[NPROC]; pp++){
-      if(pp->parent == p){
-        // make sure the child isn't still in exit() or swtch().
-        acquire(&pp->lock);
-
-        havekids = 1;
-        if(pp->state == ZOMBIE){
-          // Found one.
-          pid = pp->pid;
-          if(addr != 0 && copyout(p->pagetable, addr, (char *)&pp->xstate,
-                                  sizeof(pp->xstate)) < 0) {
-            release(&pp->lock);
-            release(&wait_lock);
-            return -1;
-          }
-          freeproc(pp);
+    for(cp = &p->children; (pp = *cp) != 0; cp = &pp->sibling){
+      if(pid != -1 && pp->pid != pid)
+        continue;
+
+      // make sure the child isn't still in exit() or swtch().
+      acquire(&pp->lock);
+
+      havekids = 1;
+      if(pp->state == ZOMBIE){
+        // Found one.
+        pid = pp->pid;
+        if(addr != 0 && copyout(p->pagetable, addr, (char *)&pp->xstate,
+                                sizeof(pp->xstate)) < 0) {
           release(&pp->lock);
           release(&wait_lock);
-          return pid;
+          return -1;
         }
+        *cp = pp->sibling;
+        freeproc(pp);
         release(&pp->lock);
+        release(&wait_lock);
+        return pid;
       }
+      release(&pp->lock);
     }
 
     // No point waiting if we don't have any children.
@@ -437,10 +822,194 @@ wait(uint64 addr)
   }
 }
 
+// Charge the running process p for the CPU time it has used
+// since it was last charged. Caller must hold p->lock.
+static void
+charge(struct proc *p)
+{
+  struct cpu *c = mycpu();
+  uint64 now = r_time();
+
+  if(p->class == SCHED_FAIR)
+    p->vruntime += (now - c->runstart) * niceweight[-NICE_MIN] /
+                   niceweight[p->nice - NICE_MIN];
+  c->runstart = now;
+}
+
+// Choose the CPU whose run queue p should join: the one it
+// last ran on, unless p may not run there any more, or p's
+// cache state there has gone cold and that queue is longer
+// than this CPU's.
+static int
+placecpu(struct proc *p)
+{
+  int id = cpuid();
+  int last = p->lastcpu;
+  int best;
+
+  if(last >= 0 && (p->affinity & (1L << last))){
+    if(last == id || (p->affinity & (1L << id)) == 0)
+      return last;
+    if(r_time() - p->lastran < MIGRATECOST || runq[last].n <= runq[id].n)
+      return last;
+    return id;
+  }
+  if(p->affinity & (1L << id))
+    return id;
+
+  // the least loaded CPU p may use.
+  best = -1;
+  for(int i = 0; i < NCPU; i++){
+    if((p->affinity & cpuonline & (1L << i)) == 0)
+      continue;
+    if(best < 0 || runq[i].n < runq[best].n)
+      best = i;
+  }
+  return best < 0 ? id : best;
+}
+
+// Mark p RUNNABLE and put it on a run queue chosen by placecpu().
+// Caller must hold p->lock.
+void
+setrunnable(struct proc *p)
+{
+  struct cpu *c = mycpu();
+  struct proc *cur;
+  struct runq *rq;
+  struct proc **pp;
+  int id = cpuid();
+  int t, kick;
+
+  if(p == c->proc)
+    charge(p);
+  p->state = RUNNABLE;
+  t = placecpu(p);
+  rq = &runq[t];
+  kick = 0;
+  acquire(&rq->lock);
+  p->rqnext = 0;
+  if(p->class == SCHED_RT){
+    if(rq->rttail)
+      rq->rttail->rqnext = p;
+    else
+      rq->rt = p;
+    rq->rttail = p;
+    // preempt a SCHED_FAIR process running there.
+    cur = cpus[t].proc;
+    if(cur && cur != p && cur->class != SCHED_RT){
+      cpus[t].resched = 1;
+      kick = t != id;
+    }
+  } else {
+    // don't let a process that slept bank CPU time.
+    if(p->vruntime < rq->minvruntime)
+      p->vruntime = rq->minvruntime;
+    for(pp = &rq->fair; *pp && (*pp)->vruntime <= p->vruntime; pp = &(*pp)->rqnext)
+      ;
+    p->rqnext = *pp;
+    *pp = p;
+  }
+  // CPU t's timer must now end the running process's slice.
+  if(++rq->n == 1)
+    kick = t != id;
+  release(&rq->lock);
+
+  // wake CPU t if it is idle, must preempt, or must set its
+  // timer. Otherwise wake an idle CPU that p may run on, which
+  // will steal p if it has gone cold before t gets to it.
+  __sync_synchronize();
+  if(t == id)
+    timerarm();
+  if(t != id && (kick || cpus[t].idle)){
+    ipi(t);
+    return;
+  }
+  for(int i = 0; i < NCPU; i++){
+    if(cpus[i].idle && i != id && (p->affinity & (1L << i))){
+      ipi(i);
+      break;
+    }
+  }
+}
+
+// Take the next process to run off rq, or return 0 if it is empty.
+static struct proc*
+runqget(struct runq *rq)
+{
+  struct proc *p;
+
+  if(rq->n == 0)
+    return 0;   // don't bother with the lock
+  acquire(&rq->lock);
+  if((p = rq->rt) != 0){
+    rq->rt = p->rqnext;
+    if(rq->rt == 0)
+      rq->rttail = 0;
+  } else if((p = rq->fair) != 0){
+    rq->fair = p->rqnext;
+    if(p->vruntime > rq->minvruntime)
+      rq->minvruntime = p->vruntime;
+  }
+  if(p)
+    rq->n--;
+  release(&rq->lock);
+  return p;
+}
+
+// May CPU id steal p from another CPU's queue?
+// now is r_time(); backlog is whether p's queue holds
+// more than one process.
+static int
+canmigrate(struct proc *p, int id, uint64 now, int backlog)
+{
+  if((p->affinity & (1L << id)) == 0)
+    return 0;
+  return backlog || now - p->lastran >= MIGRATECOST;
+}
+
+// Take a process that CPU id may run off another CPU's queue rq,
+// preferring SCHED_RT ones, or return 0 if there is none.
+static struct proc*
+runqsteal(struct runq *rq, int id)
+{
+  struct proc *p, *prev, **pp;
+  uint64 now = r_time();
+  int backlog;
+
+  if(rq->n == 0)
+    return 0;   // don't bother with the lock
+  acquire(&rq->lock);
+  backlog = rq->n > 1;
+  prev = 0;
+  for(pp = &rq->rt; (p = *pp) != 0; pp = &p->rqnext){
+    if(canmigrate(p, id, now, backlog)){
+      *pp = p->rqnext;
+      if(rq->rttail == p)
+        rq->rttail = prev;
+      goto found;
+    }
+    prev = p;
+  }
+  for(pp = &rq->fair; (p = *pp) != 0; pp = &p->rqnext){
+    if(canmigrate(p, id, now, backlog)){
+      *pp = p->rqnext;
+      goto found;
+    }
+  }
+  release(&rq->lock);
+  return 0;
+
+found:
+  rq->n--;
+  release(&rq->lock);
+  return p;
+}
+
 // Per-CPU process scheduler.
 // Each CPU calls scheduler() after setting itself up.
 // Scheduler never returns.  It loops, doing:
-//  - choose a process to run.
+//  - take a process off this CPU's run queue, or
+//    steal one from another CPU's.
 //  - swtch to start running that process.
 //  - eventually that process transfers control
 //    via swtch back to the scheduler.
@@ -449,28 +1018,57 @@ scheduler(void)
 {
   struct proc *p;
   struct cpu *c = mycpu();
+  int id = cpuid();
   
   c->proc = 0;
+  __sync_fetch_and_or(&cpuonline, 1L << id);
   for(;;){
     // Avoid deadlock by ensuring that devices can interrupt.
     intr_on();
 
-    for(p = proc; p < &proc[NPROC]; p++) {
-      acquire(&p->lock);
-      if(p->state == RUNNABLE) {
-        // Switch to chosen process.  It is the process's job
-        // to release its lock and then reacquire it
-        // before jumping back to us.
-        p->state = RUNNING;
-        c->proc = p;
-        swtch(&c->context, &p->context);
-
-        // Process is done running for now.
-        // It should have changed its p->state before coming back.
-        c->proc = 0;
-      }
-      release(&p->lock);
+    p = runqget(&runq[id]);
+    for(int i = 1; p == 0 && i < NCPU; i++)
+      p = runqsteal(&runq[(id + i) % NCPU], id);
+    if(p == 0){
+      // Nothing to do: halt in wfi until an interrupt, such as
+      // the IPI from setrunnable() or the timer, which lets us
+      // look again for processes that have gone cold. Interrupts
+      // are off so that one arriving after the check still ends
+      // the wfi; it is taken once intr_on() enables them again.
+      intr_off();
+      c->idle = 1;
+      __sync_synchronize();
+      timerarm();
+      if(runq[id].n == 0)
+        asm volatile("wfi");
+      c->idle = 0;
+      continue;
+    }
+
+    // Once off the queue, p is ours to run; its lock may
+    // still be held by the CPU that is switching away from it.
+    acquire(&p->lock);
+    if(p->state == RUNNABLE && (p->affinity & (1L << id)) == 0){
+      // its affinity changed while it was queued here.
+      setrunnable(p);
+    } else if(p->state == RUNNABLE) {
+      // Switch to chosen process.  It is the process's job
+      // to release its lock and then reacquire it
+      // before jumping back to us.
+      p->state = RUNNING;
+      c->proc = p;
+      c->runstart = r_time();
+      c->slicestart = c->runstart;
+      c->resched = 0;
+      p->lastcpu = id;
+      timerarm();
+      swtch(&c->context, &p->context);
+
+      // Process is done running for now.
+      // It should have changed its p->state before coming back.
+      c->proc = 0;
     }
+    release(&p->lock);
   }
 }
 
@@ -496,6 +1094,8 @@ sched(void)
   if(intr_get())
     panic("sched interruptible");
 
+  charge(p);
+  p->lastran = r_time();
   intena = mycpu()->intena;
   swtch(&p->context, &mycpu()->context);
   mycpu()->intena = intena;
@@ -507,9 +1107,86 @@ yield(void)
 {
   struct proc *p = myproc();
   acquire(&p->lock);
-  p->state = RUNNABLE;
+  setrunnable(p);
+  sched();
+  release(&p->lock);
+}
+
+// Create a kernel thread that runs fn(arg) on its kernel
+// stack, with no user memory or open files, and make it
+// RUNNABLE. The thread ends by returning from fn or calling
+// kthread_exit(); kthread_join() waits for that and frees it.
+// Returns 0 if there are no free procs.
+struct proc*
+kthread_create(char *name, void (*fn)(void*), void *arg)
+{
+  struct proc *p;
+
+  if((p = allocproc(0)) == 0)
+    return 0;
+  safestrcpy(p->name, name, sizeof(p->name));
+  p->kfn = fn;
+  p->karg = arg;
+  setrunnable(p);
+  release(&p->lock);
+  return p;
+}
+
+// End the current kernel thread. The thread remains a zombie
+// until kthread_join() collects it.
+void
+kthread_exit(int status)
+{
+  struct proc *p = myproc();
+
+  acquire(&wait_lock);
+
+  // kthread_join() may be sleeping on p.
+  wakeup(p);
+
+  acquire(&p->lock);
+  p->xstate = status;
+  p->state = ZOMBIE;
+  release(&wait_lock);
+
   sched();
+  panic("zombie kthread exit");
+}
+
+// Wait for kernel thread p to exit, free it,
+// and return its exit status.
+int
+kthread_join(struct proc *p)
+{
+  int status;
+
+  acquire(&wait_lock);
+  for(;;){
+    acquire(&p->lock);
+    if(p->state == ZOMBIE){
+      status = p->xstate;
+      freeproc(p);
+      release(&p->lock);
+      release(&wait_lock);
+      return status;
+    }
+    release(&p->lock);
+    sleep(p, &wait_lock);
+  }
+}
+
+// A kernel thread's very first scheduling by scheduler()
+// will swtch to kthreadstart.
+static void
+kthreadstart(void)
+{
+  struct proc *p = myproc();
+
+  // Still holding p->lock from scheduler.
   release(&p->lock);
+
+  p->kfn(p->karg);
+  kthread_exit(0);
 }
 
 // A fork child's very first scheduling by scheduler()
@@ -533,77 +1210,358 @@ forkret(void)
   usertrapret();
 }
 
-// Atomically release lock and sleep on chan.
-// Reacquires lock when awakened.
+// Swap heap entries i and j of tq.
+static void
+tqswap(struct timerq *tq, int i, int j)
+{
+  struct proc *t = tq->heap[i];
+
+  tq->heap[i] = tq->heap[j];
+  tq->heap[j] = t;
+  tq->heap[i]->tqidx = i;
+  tq->heap[j]->tqidx = j;
+}
+
+// Restore the heap order of tq around entry i.
+static void
+tqfix(struct timerq *tq, int i)
+{
+  int c;
+
+  while(i > 0 && tq->heap[i]->deadline < tq->heap[(i-1)/2]->deadline){
+    tqswap(tq, i, (i-1)/2);
+    i = (i-1)/2;
+  }
+  for(;;){
+    c = 2*i + 1;
+    if(c >= tq->n)
+      break;
+    if(c+1 < tq->n && tq->heap[c+1]->deadline < tq->heap[c]->deadline)
+      c++;
+    if(tq->heap[i]->deadline <= tq->heap[c]->deadline)
+      break;
+    tqswap(tq, i, c);
+    i = c;
+  }
+}
+
+// Remove p from its timer heap. Caller must hold that heap's lock.
+static void
+tqremove(struct proc *p)
+{
+  struct timerq *tq = &timerq[p->tq];
+  int i = p->tqidx;
+
+  tq->n--;
+  if(i != tq->n){
+    tqswap(tq, i, tq->n);
+    tqfix(tq, i);
+  }
+  p->tq = -1;
+}
+
+// Wake the processes whose sleepuntil() deadlines have passed,
+// on this CPU's timer interrupt.
 void
-sleep(void *chan, struct spinlock *lk)
+timerexpire(void)
+{
+  struct timerq *tq = &timerq[cpuid()];
+  struct proc *p;
+  uint64 now = r_time();
+
+  for(;;){
+    acquire(&tq->lock);
+    if(tq->n == 0 || (p = tq->heap[0])->deadline > now){
+      release(&tq->lock);
+      break;
+    }
+    tqremove(p);
+    release(&tq->lock);
+
+    // p may have been woken and gone back to sleep meanwhile;
+    // waking it early is harmless, as for any sleep().
+    acquire(&p->lock);
+    if(p->state == SLEEPING)
+      setrunnable(p);
+    release(&p->lock);
+  }
+}
+
+// Atomically release lock and sleep on chan, until woken, or
+// until r_time() reaches deadline unless that is ~0.
+// Reacquires lock when awakened.
+static void
+sleepon(void *chan, struct spinlock *lk, uint64 deadline)
 {
   struct proc *p = myproc();
+  struct waitq *wq = WAITQ(chan);
+  struct timerq *tq;
+  struct proc **pp;
+  int t;
   
-  // Must acquire p->lock in order to
-  // change p->state and then call sched.
-  // Once we hold p->lock, we can be
+  // Once we hold chan's wait queue lock, we can be
   // guaranteed that we won't miss any wakeup
-  // (wakeup locks p->lock),
+  // (wakeup locks the wait queue),
   // so it's okay to release lk.
-
-  acquire(&p->lock);  //DOC: sleeplock1
+  acquire(&wq->lock);  //DOC: sleeplock1
   release(lk);
 
+  // Must acquire p->lock in order to
+  // change p->state and then call sched.
+  acquire(&p->lock);
+
   // Go to sleep.
   p->chan = chan;
   p->state = SLEEPING;
+  p->wqnext = wq->head;
+  wq->head = p;
+  release(&wq->lock);
+
+  // timerexpire() needs p->lock to wake p, so it
+  // cannot do so until sched() has switched away.
+  if(deadline != ~0ULL){
+    tq = &timerq[cpuid()];
+    acquire(&tq->lock);
+    p->deadline = deadline;
+    p->tq = cpuid();
+    p->tqidx = tq->n++;
+    tq->heap[p->tqidx] = p;
+    tqfix(tq, p->tqidx);
+    release(&tq->lock);
+  }
 
   sched();
 
   // Tidy up.
   p->chan = 0;
+  release(&p->lock);
+
+  acquire(&wq->lock);
+  for(pp = &wq->head; *pp != p; pp = &(*pp)->wqnext)
+    ;
+  *pp = p->wqnext;
+  release(&wq->lock);
+
+  if((t = p->tq) >= 0){
+    acquire(&timerq[t].lock);
+    if(p->tq == t)
+      tqremove(p);
+    release(&timerq[t].lock);
+  }
 
   // Reacquire original lock.
-  release(&p->lock);
   acquire(lk);
 }
 
+// Atomically release lock and sleep on chan.
+// Reacquires lock when awakened.
+void
+sleep(void *chan, struct spinlock *lk)
+{
+  sleepon(chan, lk, ~0ULL);
+}
+
+// Like sleep(), but also wake up once r_time() reaches
+// deadline. Returns 0 if woken before the deadline,
+// and -1 if it has passed.
+int
+sleepuntil(void *chan, struct spinlock *lk, uint64 deadline)
+{
+  if(r_time() >= deadline)
+    return -1;
+  sleepon(chan, lk, deadline);
+  return r_time() >= deadline ? -1 : 0;
+}
+
 // Wake up all processes sleeping on chan.
 // Must be called without any p->lock.
 void
 wakeup(void *chan)
 {
+  wakeupn(chan, NPROC);
+}
+
+// Wake up at most n of the processes sleeping on chan,
+// and return how many were woken.
+// Must be called without any p->lock.
+int
+wakeupn(void *chan, int n)
+{
+  struct waitq *wq = WAITQ(chan);
   struct proc *p;
+  int woken = 0;
 
-  for(p = proc; p < &proc[NPROC]; p++) {
-    if(p != myproc()){
-      acquire(&p->lock);
-      if(p->state == SLEEPING && p->chan == chan) {
-        p->state = RUNNABLE;
-      }
-      release(&p->lock);
+  acquire(&wq->lock);
+  for(p = wq->head; p && woken < n; p = p->wqnext){
+    acquire(&p->lock);
+    if(p->state == SLEEPING && p->chan == chan) {
+      setrunnable(p);
+      woken++;
     }
+    release(&p->lock);
   }
+  release(&wq->lock);
+  return woken;
 }
 
-// Kill the process with the given pid.
-// The victim won't exit until it tries to return
-// to user space (see usertrap() in trap.c).
+// Kill the process with the given pid, and the other threads
+// of its process. The victims won't exit until they try to
+// return to user space (see usertrap() in trap.c).
 int
 kill(int pid)
+{
+  struct proc *p, *q;
+  struct tgroup *tg;
+
+  if((p = pidlookup(pid)) == 0)
+    return -1;
+  p->killed = 1;
+  if(p->state == SLEEPING){
+    // Wake process from sleep().
+    setrunnable(p);
+  }
+  if((tg = p->tg) != 0){
+    acquire(&tg->lock);
+    tg->killed = 1;
+    release(&tg->lock);
+  }
+  release(&p->lock);
+  if(tg == 0)
+    return 0;
+
+  // Wake the group's sleeping threads, so they see killed().
+  // Procs are never freed, so the list is safe to walk. Should
+  // the group be freed meanwhile and its page reused for
+  // another, that one's threads only wake up spuriously.
+  acquire(&ptable.lock);
+  q = ptable.all;
+  release(&ptable.lock);
+  for(; q; q = q->allnext){
+    if(q == p)
+      continue;
+    acquire(&q->lock);
+    if(q->tg == tg && q->state == SLEEPING)
+      setrunnable(q);
+    release(&q->lock);
+  }
+  return 0;
+}
+
+// Set the scheduling class and nice value of the process
+// with the given pid, or of the caller if pid is 0.
+int
+setpriority(int pid, int class, int nice)
 {
   struct proc *p;
 
-  for(p = proc; p < &proc[NPROC]; p++){
-    acquire(&p->lock);
-    if(p->pid == pid){
-      p->killed = 1;
-      if(p->state == SLEEPING){
-        // Wake process from sleep().
-        p->state = RUNNABLE;
-      }
-      release(&p->lock);
-      return 0;
+  if(class != SCHED_FAIR && class != SCHED_RT)
+    return -1;
+  if(nice < NICE_MIN || nice > NICE_MAX)
+    return -1;
+  if(pid == 0)
+    pid = myproc()->pid;
+
+  if((p = pidlookup(pid)) == 0)
+    return -1;
+  if(p == myproc())
+    charge(p);
+  p->class = class;
+  p->nice = nice;
+  release(&p->lock);
+  return 0;
+}
+
+// Set the time slice to usec microseconds, unless usec is 0,
+// and return the old one. The slice is the same for every CPU,
+// so one below MINQUANTUM (1ms) would have every timer firing
+// for nothing but switches; returns -1 for that.
+int
+setquantum(int usec)
+{
+  int old = quantum / (TIMEFREQ / 1000000);
+
+  if(usec > 0 && (uint64)usec * (TIMEFREQ / 1000000) < MINQUANTUM)
+    return -1;
+  if(usec > 0)
+    quantum = (uint64)usec * (TIMEFREQ / 1000000);
+  return old;
+}
+
+// Set this CPU's timer for the next time it must act: when the
+// running process's slice ends, if another process waits in
+// this CPU's queue; when processes queued elsewhere become
+// cold enough for an idle CPU to steal; and when the first
+// sleepuntil() deadline in its heap passes. Without any of these the timer is
+// left off, so a CPU-bound process that has its CPU to itself
+// is never interrupted, and an idle CPU stays in wfi.
+// Sets c->resched if the slice is already over.
+// Interrupts must be off.
+void
+timerarm(void)
+{
+  struct cpu *c = mycpu();
+  int id = cpuid();
+  uint64 when = ~0ULL;
+  uint64 now = r_time();
+
+  if(c->proc && runq[id].n > 0){
+    when = c->slicestart + quantum;
+    if(when <= now){
+      c->resched = 1;
+      when = ~0ULL;
+    }
+  } else if(c->proc == 0){
+    for(int i = 0; i < NCPU; i++)
+      if(i != id && runq[i].n > 0)
+        when = now + MIGRATECOST;
+  }
+  acquire(&timerq[id].lock);
+  if(timerq[id].n > 0 && timerq[id].heap[0]->deadline < when)
+    when = timerq[id].heap[0]->deadline;
+  release(&timerq[id].lock);
+  settimer(when);
+}
+
+// Restrict the process with the given pid (or the caller, if
+// pid is 0) to the CPUs in mask. A process running on a CPU
+// it may no longer use is made to reschedule.
+int
+setaffinity(int pid, uint64 mask)
+{
+  struct proc *p;
+
+  mask &= cpuonline;
+  if(mask == 0)
+    return -1;
+  if(pid == 0)
+    pid = myproc()->pid;
+
+  if((p = pidlookup(pid)) == 0)
+    return -1;
+  p->affinity = mask;
+  for(int i = 0; i < NCPU; i++){
+    if(cpus[i].proc == p && (mask & (1L << i)) == 0){
+      cpus[i].resched = 1;
+      if(i != cpuid())
+        ipi(i);
     }
-    release(&p->lock);
   }
-  return -1;
+  release(&p->lock);
+  return 0;
+}
+
+// Should the current process give way to a SCHED_RT process
+// that setrunnable() queued on this CPU? Clears the request.
+int
+needresched(void)
+{
+  int r;
+
+  push_off();
+  r = mycpu()->resched;
+  mycpu()->resched = 0;
+  pop_off();
+  return r;
 }
 
 void
@@ -621,6 +1579,11 @@ killed(struct proc *p)
   
   acquire(&p->lock);
   k = p->killed;
+  if(!k && p->tg){
+    acquire(&p->tg->lock);
+    k = p->tg->killed;
+    release(&p->tg->lock);
+  }
   release(&p->lock);
   return k;
 }
@@ -673,7 +1636,7 @@ procdump(void)
   char *state;
 
   printf("\n");
-  for(p = proc; p < &proc[NPROC]; p++){
+  for(p = ptable.all; p; p = p->allnext){
     if(p->state == UNUSED)
       continue;
     if(p->state >= 0 && p->state < NELEM(states) && states[p->state])
@@ -24,6 +24,11 @@ struct cpu {
   struct context context;     // swtch() here to enter scheduler().
   int noff;                   // Depth of push_off() nesting.
   int intena;                 // Were interrupts enabled before push_off()?
+  int idle;                   // In wfi in scheduler(), waiting for work
+  int resched;                // Time slice over, or a SCHED_RT process waits
+  uint64 runstart;            // When proc was last charged for CPU time
+  uint64 slicestart;          // When proc was switched to
+  struct tgroup *inuser;      // tg of the thread this CPU runs in user mode
 };
 
 extern struct cpu cpus[NCPU];
@@ -79,8 +84,46 @@ struct trapframe {
   /* 280 */ uint64 t6;
 };
 
+// A range of user address space whose pages are not mapped
+// up front but filled in by vmfault() on first touch, such as
+// an ELF segment of the running program or an mmap() region.
+// Unused slots in p->vma[] have end == 0.
+struct vma {
+  uint64 start;        // first address, page-aligned
+  uint64 end;          // one past the last address, page-aligned
+  int perm;            // PTE_R, PTE_W, PTE_X for the region's pages
+  int flags;           // MAP_SHARED or MAP_PRIVATE for mmap(), else 0
+  struct inode *ip;    // backing file, or 0 if anonymous
+  uint off;            // file offset of start
+  uint filesz;         // bytes backed by the file; the rest is zero
+};
+
 enum procstate { UNUSED, USED, SLEEPING, RUNNABLE, RUNNING, ZOMBIE };
 
+// State shared by the threads of a process: its memory,
+// open files, and current directory. fork() makes a new
+// group; clone() adds a thread to the caller's.
+struct tgroup {
+  struct spinlock lock;
+
+  // lock must be held when using these:
+  int ref;                     // Procs using the group, zombies included
+  int nlive;                   // Threads that have not exited
+  uint64 slots;                // THREADFRAME slots in use, by tslot
+  int faulting;                // Threads filling a page with lock released
+  int pause;                   // If non-zero, threads wait before user mode
+  int killed;                  // If non-zero, every thread has been killed
+  uint64 sz;                   // Size of process memory (bytes)
+  struct vma vma[NVMA];        // Demand-paged regions
+  struct file *ofile[NOFILE];  // Open files
+  struct inode *cwd;           // Current directory
+
+  // Held while a user page is used through the direct map by
+  // copyin()/copyout(), or unmapped and freed while other
+  // threads may be running.
+  struct spinlock pglock;
+};
+
 // Per-process state
 struct proc {
   struct spinlock lock;
@@ -91,17 +134,42 @@ struct proc {
   int killed;                  // If non-zero, have been killed
   int xstate;                  // Exit status to be returned to parent's wait
   int pid;                     // Process ID
+  int class;                   // SCHED_FAIR or SCHED_RT
+  int nice;                    // Weight within SCHED_FAIR
+  uint64 vruntime;             // SCHED_FAIR CPU time, scaled by weight
+  uint64 affinity;             // Mask of CPUs the process may run on
+  int lastcpu;                 // CPU it last ran on, or -1
+  uint64 lastran;              // r_time() when it last stopped running
+  uint64 deadline;             // When sleepuntil() must wake it
+
+  // the run queue's lock must be held when using this:
+  struct proc *rqnext;         // Next on a CPU's run queue
+
+  // the wait queue's lock must be held when using this:
+  struct proc *wqnext;         // Next sleeper in the wait queue
+
+  // the timer heap's lock must be held when using these:
+  int tq;                      // CPU whose timer heap holds it, or -1
+  int tqidx;                   // Its index in that heap
 
-  // wait_lock must be held when using this:
+  // wait_lock must be held when using these:
   struct proc *parent;         // Parent process
+  struct proc *children;       // Its children, linked through sibling
+  struct proc *sibling;        // Next child of the same parent
+
+  // ptable.lock must be held when using these:
+  struct proc *pidnext;        // Pid hash chain, or free list
+  struct proc *allnext;        // Every proc ever allocated
 
   // these are private to the process, so p->lock need not be held.
   uint64 kstack;               // Virtual address of kernel stack
-  uint64 sz;                   // Size of process memory (bytes)
-  pagetable_t pagetable;       // User page table
+  struct tgroup *tg;           // Memory and files, shared with its threads
+  pagetable_t pagetable;       // User page table, the same for all of tg
   struct trapframe *trapframe; // data page for trampoline.S
+  int tslot;                   // trapframe is mapped at THREADFRAME(tslot)
   struct context context;      // swtch() here to run process
-  struct file *ofile[NOFILE];  // Open files
-  struct inode *cwd;           // Current directory
   char name[16];               // Process name (debugging)
+  void (*kfn)(void*);          // Kernel thread function, if any
+  void *karg;                  // Argument to kfn
+  struct sleeplock *shared[NSHARED]; // Sleep locks it shares, or 0
 };
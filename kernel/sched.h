@@ -0,0 +1,7 @@
+// Scheduling classes, for setpriority().
+#define SCHED_FAIR  0   // CPU shared in proportion to nice weights
+#define SCHED_RT    1   // runs ahead of every SCHED_FAIR process
+
+// nice values of the SCHED_FAIR class; lower gets more CPU.
+#define NICE_MIN  -20
+#define NICE_MAX   19
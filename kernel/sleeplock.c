@@ -15,18 +15,31 @@ initsleeplock(struct sleeplock *lk, char *name)
   initlock(&lk->lk, "sleep lock");
   lk->name = name;
   lk->locked = 0;
+  lk->readers = 0;
+  lk->writers = 0;
   lk->pid = 0;
+  lk->class = lockclassof(name, 1);
 }
 
 void
 acquiresleep(struct sleeplock *lk)
 {
+  uint64 start, sleeps;
+
+  start = r_time();
+  sleeps = 0;
   acquire(&lk->lk);
-  while (lk->locked) {
+  while (lk->locked || lk->readers) {
+    // new readers wait while we do.
+    lk->writers++;
     sleep(lk, &lk->lk);
+    lk->writers--;
+    sleeps++;
   }
   lk->locked = 1;
   lk->pid = myproc()->pid;
+  lk->holdstart = r_time();
+  lockacquired(lk->class, lk->holdstart - start, sleeps);
   release(&lk->lk);
 }
 
@@ -34,12 +47,82 @@ void
 releasesleep(struct sleeplock *lk)
 {
   acquire(&lk->lk);
+  lockreleased(lk->class, r_time() - lk->holdstart);
   lk->locked = 0;
   lk->pid = 0;
   wakeup(lk);
   release(&lk->lk);
 }
 
+// Acquire the lock shared with other readers. A waiting writer
+// holds back new readers, so that a steady stream of them cannot
+// starve it. A process must not share a lock it already shares,
+// since it would wait for that writer, which waits for it; code
+// that may run with the lock shared, such as a page fault inside
+// readi(), checks holdingsleepshared() first. Hold times are not
+// recorded for shared holders.
+void
+acquiresleepshared(struct sleeplock *lk)
+{
+  struct proc *p = myproc();
+  uint64 start, sleeps;
+  int i;
+
+  for (i = 0; i < NSHARED && p->shared[i]; i++)
+    if (p->shared[i] == lk)
+      panic("acquiresleepshared: nested");
+  if (i == NSHARED)
+    panic("acquiresleepshared: too many");
+
+  start = r_time();
+  sleeps = 0;
+  acquire(&lk->lk);
+  while (lk->locked || lk->writers) {
+    sleep(lk, &lk->lk);
+    sleeps++;
+  }
+  lk->readers++;
+  lockacquired(lk->class, r_time() - start, sleeps);
+  release(&lk->lk);
+  p->shared[i] = lk;
+}
+
+void
+releasesleepshared(struct sleeplock *lk)
+{
+  struct proc *p = myproc();
+  int i;
+
+  for (i = 0; i < NSHARED && p->shared[i] != lk; i++)
+    ;
+  if (i == NSHARED)
+    panic("releasesleepshared: not held");
+  for (; i < NSHARED - 1; i++)
+    p->shared[i] = p->shared[i+1];
+  p->shared[NSHARED - 1] = 0;
+
+  acquire(&lk->lk);
+  if (lk->readers < 1)
+    panic("releasesleepshared");
+  if (--lk->readers == 0)
+    wakeup(lk);
+  release(&lk->lk);
+}
+
+// Is the current process sharing the lock?
+int
+holdingsleepshared(struct sleeplock *lk)
+{
+  struct proc *p = myproc();
+  int i;
+
+  for (i = 0; i < NSHARED && p->shared[i]; i++)
+    if (p->shared[i] == lk)
+      return 1;
+  return 0;
+}
+
+// Is the current process holding the lock exclusively?
 int
 holdingsleep(struct sleeplock *lk)
 {
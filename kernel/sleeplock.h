@@ -1,10 +1,18 @@
-// Long-term locks for processes
+// Long-term locks for processes.
+// Held either exclusively by one process, or shared by any
+// number of readers.
 struct sleeplock {
-  uint locked;       // Is the lock held?
+  uint locked;       // Is the lock held exclusively?
+  int readers;       // Number of processes sharing the lock
+  int writers;       // Number of processes waiting to hold it exclusively
   struct spinlock lk; // spinlock protecting this sleep lock
   
   // For debugging:
   char *name;        // Name of lock.
   int pid;           // Process holding lock
+
+  // For statistics:
+  int class;         // Lock class, as for spinlocks
+  uint64 holdstart;  // r_time() when acquired
 };
 
@@ -7,13 +7,87 @@
 #include "riscv.h"
 #include "proc.h"
 #include "defs.h"
+#include "lockstat.h"
+
+// Lock statistics are kept per name, since locks in memory that
+// is freed, such as a pipe's, cannot be kept track of one by one,
+// and per CPU, so that recording them needs no atomic operations
+// and shares no cache lines. A lock's class is its name's index
+// in lockclass[]; names beyond NLOCKCLASS share the last one.
+// Spin and sleep locks with the same name are separate classes.
+struct lockcount {
+  uint64 nacquire;
+  uint64 ncontended;
+  uint64 nspin;
+  uint64 waittime;
+  uint64 maxwait;
+  uint64 holdtime;
+  uint64 maxhold;
+};
+
+static char *lockclass[NLOCKCLASS];
+static char locksleep[NLOCKCLASS];
+static struct lockcount lockcount[NCPU][NLOCKCLASS];
+
+// Return the class of locks named name, adding it if new.
+// sleep says whether they are sleep locks.
+int
+lockclassof(char *name, int sleep)
+{
+  int i;
+
+  for(i = 0; i < NLOCKCLASS-1; i++){
+    if(lockclass[i] == 0 && __sync_bool_compare_and_swap(&lockclass[i], 0, name)){
+      locksleep[i] = sleep;
+      return i;
+    }
+    // a class just claimed by another CPU may not have its
+    // kind set yet; at worst the lock shares a class.
+    if(strncmp(lockclass[i], name, 16) == 0 && locksleep[i] == sleep)
+      return i;
+  }
+  lockclass[i] = "other";
+  return i;
+}
+
+// Count an acquisition of a lock of class c that waited
+// wait r_time() units, going round its wait loop spins times.
+// Interrupts must be off.
+void
+lockacquired(int c, uint64 wait, uint64 spins)
+{
+  struct lockcount *s = &lockcount[cpuid()][c];
+
+  s->nacquire++;
+  if(spins){
+    s->ncontended++;
+    s->nspin += spins;
+    s->waittime += wait;
+    if(wait > s->maxwait)
+      s->maxwait = wait;
+  }
+}
+
+// Count a release of a lock of class c held for held
+// r_time() units. Interrupts must be off.
+void
+lockreleased(int c, uint64 held)
+{
+  struct lockcount *s = &lockcount[cpuid()][c];
+
+  s->holdtime += held;
+  if(held > s->maxhold)
+    s->maxhold = held;
+}
 
 void
 initlock(struct spinlock *lk, char *name)
 {
   lk->name = name;
-  lk->locked = 0;
+  lk->next = 0;
+  lk->owner = 0;
   lk->cpu = 0;
+  lk->class = lockclassof(name, 0);
 }
 
 // Acquire the lock.
@@ -21,16 +95,23 @@ initlock(struct spinlock *lk, char *name)
 void
 acquire(struct spinlock *lk)
 {
+  uint64 spins, start;
+  uint t;
+
   push_off(); // disable interrupts to avoid deadlock.
   if(holding(lk))
     panic("acquire");
 
-  // On RISC-V, sync_lock_test_and_set turns into an atomic swap:
-  //   a5 = 1
-  //   s1 = &lk->locked
-  //   amoswap.w.aq a5, a5, (s1)
-  while(__sync_lock_test_and_set(&lk->locked, 1) != 0)
-    ;
+  // Take a ticket, and wait for its turn. Waiting CPUs only
+  // load owner, so its cache line stays shared among them
+  // until release() stores to it, instead of bouncing between
+  // them on every atomic swap.
+  // On RISC-V, sync_fetch_and_add turns into amoadd.w.
+  start = r_time();
+  t = __sync_fetch_and_add(&lk->next, 1);
+  spins = 0;
+  while(__atomic_load_n(&lk->owner, __ATOMIC_ACQUIRE) != t)
+    spins++;
 
   // Tell the C compiler and the processor to not move loads or stores
   // past this point, to ensure that the critical section's memory
@@ -40,6 +121,8 @@ acquire(struct spinlock *lk)
 
   // Record info about lock acquisition for holding() and debugging.
   lk->cpu = mycpu();
+  lk->holdstart = r_time();
+  lockacquired(lk->class, lk->holdstart - start, spins);
 }
 
 // Release the lock.
@@ -49,6 +132,8 @@ release(struct spinlock *lk)
   if(!holding(lk))
     panic("release");
 
+  lockreleased(lk->class, r_time() - lk->holdstart);
+
   lk->cpu = 0;
 
   // Tell the C compiler and the CPU to not move loads or stores
@@ -59,14 +144,10 @@ release(struct spinlock *lk)
   // On RISC-V, this emits a fence instruction.
   __sync_synchronize();
 
-  // Release the lock, equivalent to lk->locked = 0.
-  // This code doesn't use a C assignment, since the C standard
-  // implies that an assignment might be implemented with
-  // multiple store instructions.
-  // On RISC-V, sync_lock_release turns into an atomic swap:
-  //   s1 = &lk->locked
-  //   amoswap.w zero, zero, (s1)
-  __sync_lock_release(&lk->locked);
+  // Release the lock by passing the turn to the next ticket.
+  // Only the holder stores to owner, so this need not be an
+  // atomic read-modify-write, but it must be a single store.
+  __atomic_store_n(&lk->owner, lk->owner + 1, __ATOMIC_RELEASE);
 
   pop_off();
 }
@@ -77,10 +158,68 @@ int
 holding(struct spinlock *lk)
 {
   int r;
-  r = (lk->locked && lk->cpu == mycpu());
+  r = (lk->owner != lk->next && lk->cpu == mycpu());
   return r;
 }
 
+// Sum the statistics of class i over the CPUs into *t.
+static void
+locksum(int i, struct lockstat *t)
+{
+  struct lockcount *s;
+  int c;
+
+  memset(t, 0, sizeof(*t));
+  safestrcpy(t->name, lockclass[i], sizeof(t->name));
+  t->sleep = locksleep[i];
+  for(c = 0; c < NCPU; c++){
+    s = &lockcount[c][i];
+    t->nacquire += s->nacquire;
+    t->ncontended += s->ncontended;
+    t->nspin += s->nspin;
+    t->waittime += s->waittime;
+    t->holdtime += s->holdtime;
+    if(s->maxwait > t->maxwait)
+      t->maxwait = s->maxwait;
+    if(s->maxhold > t->maxhold)
+      t->maxhold = s->maxhold;
+  }
+}
+
+// Copy out the statistics of up to n lock classes to the
+// user array of struct lockstat at addr.
+// Returns the number of classes copied, or -1.
+int
+lockstats(uint64 addr, int n)
+{
+  struct lockstat t;
+  int i;
+
+  for(i = 0; i < n && i < NLOCKCLASS && lockclass[i]; i++){
+    locksum(i, &t);
+    if(copyout(myproc()->pagetable, addr + i*sizeof(t), (char*)&t, sizeof(t)) < 0)
+      return -1;
+  }
+  return i;
+}
+
+// Print the statistics of each class of locks, summed over
+// the CPUs, on the console. Runs when a user types ^L.
+void
+lockdump(void)
+{
+  struct lockstat t;
+  int i;
+
+  printf("\n");
+  for(i = 0; i < NLOCKCLASS && lockclass[i]; i++){
+    locksum(i, &t);
+    printf("%s%s: acquire %l contended %l wait %l maxwait %l hold %l maxhold %l\n",
+           t.name, t.sleep ? " (sleep)" : "", t.nacquire, t.ncontended,
+           t.waittime, t.maxwait, t.holdtime, t.maxhold);
+  }
+}
+
 // push_off/pop_off are like intr_off()/intr_on() except that they are matched:
 // it takes two pop_off()s to undo two push_off()s.  Also, if interrupts
 // are initially off, then push_off, pop_off leaves them off.
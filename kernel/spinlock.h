@@ -2,12 +2,18 @@
 #define SPINLOCK_H
 
 // Mutual exclusion lock.
+// A ticket lock: CPUs get it in the order they asked for it.
 struct spinlock {
-  uint locked;       // Is the lock held?
+  uint next;         // Ticket for the next CPU to ask
+  uint owner;        // Ticket of the CPU whose turn it is
 
   // For debugging:
   char *name;        // Name of lock.
   struct cpu *cpu;   // The cpu holding the lock.
+
+  // For statistics:
+  int class;         // Index of name in lockclass[]
+  uint64 holdstart;  // r_time() when acquired
 };
 
 #endif
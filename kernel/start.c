@@ -11,7 +11,7 @@ void timerinit();
 __attribute__ ((aligned (16))) char stack0[4096 * NCPU];
 
 // a scratch area per CPU for machine-mode timer interrupts.
-uint64 timer_scratch[NCPU][5];
+uint64 timer_scratch[NCPU][7];
 
 // assembly code in kernelvec.S for machine-mode timer interrupt.
 extern void timervec();
@@ -43,6 +43,11 @@ start()
   w_pmpaddr0(0x3fffffffffffffull);
   w_pmpcfg0(0xf);
 
+  // let supervisor and user mode read the cycle, time and
+  // instret counters, for benchmarks such as copybench.
+  w_mcounteren(r_mcounteren() | 0x7);
+  w_scounteren(r_scounteren() | 0x7);
+
   // ask for clock interrupts.
   timerinit();
 
@@ -65,17 +70,21 @@ timerinit()
   // each CPU has a separate source of timer interrupts.
   int id = r_mhartid();
 
-  // ask the CLINT for a timer interrupt.
-  int interval = 1000000; // cycles; about 1/10th second in qemu.
-  *(uint64*)CLINT_MTIMECMP(id) = *(uint64*)CLINT_MTIME + interval;
+  // the timer stays off until the kernel asks for an
+  // interrupt with settimer().
+  *(uint64*)CLINT_MTIMECMP(id) = ~0ULL;
 
   // prepare information in scratch[] for timervec.
   // scratch[0..2] : space for timervec to save registers.
   // scratch[3] : address of CLINT MTIMECMP register.
-  // scratch[4] : desired interval (in cycles) between timer interrupts.
+  // scratch[4] : unused.
+  // scratch[5] : address of CLINT MSIP register, for IPIs.
+  // scratch[6] : set by timervec on each timer interrupt.
   uint64 *scratch = &timer_scratch[id][0];
   scratch[3] = CLINT_MTIMECMP(id);
-  scratch[4] = interval;
+  scratch[4] = 0;
+  scratch[5] = CLINT_MSIP(id);
+  scratch[6] = 0;
   w_mscratch((uint64)scratch);
 
   // set the machine-mode trap handler.
@@ -84,6 +93,31 @@ timerinit()
   // enable machine-mode interrupts.
   w_mstatus(r_mstatus() | MSTATUS_MIE);
 
-  // enable machine-mode timer interrupts.
-  w_mie(r_mie() | MIE_MTIE);
+  // enable machine-mode timer and software (IPI) interrupts.
+  w_mie(r_mie() | MIE_MTIE | MIE_MSIE);
+}
+
+// Return 1 if timervec has seen a timer interrupt on this CPU
+// since the last call, and 0 if the software interrupt that
+// devintr() is handling was only an IPI.
+int
+clockticked(void)
+{
+  return __sync_lock_test_and_set(&timer_scratch[cpuid()][6], 0) != 0;
+}
+
+// Send an IPI to CPU id, to end its wfi in scheduler().
+void
+ipi(int id)
+{
+  *(uint32*)CLINT_MSIP(id) = 1;
+}
+
+// Ask for a timer interrupt on this CPU once r_time() reaches
+// when, replacing any earlier request; ~0 turns the timer off.
+// timervec turns it off again when it fires.
+void
+settimer(uint64 when)
+{
+  *(uint64*)CLINT_MTIMECMP(cpuid()) = when;
 }
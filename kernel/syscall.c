@@ -12,7 +12,7 @@ int
 fetchaddr(uint64 addr, uint64* ip)
 {
   struct proc* p = myproc();
-  if (addr >= p->sz || addr + sizeof(uint64) > p->sz) // both tests needed, in case of overflow
+  if (addr >= p->tg->sz || addr + sizeof(uint64) > p->tg->sz) // both tests needed, in case of overflow
     return -1;
   if (copyin(p->pagetable, (char*)ip, addr, sizeof(*ip)) != 0)
     return -1;
@@ -102,8 +102,30 @@ extern uint64 sys_link(void);
 extern uint64 sys_mkdir(void);
 extern uint64 sys_close(void);
 extern uint64 sys_flush(void);
-extern uint64 sys_commit_worker(void);
 extern uint64 sys_ftruncate(void);
+extern uint64 sys_mmap(void);
+extern uint64 sys_munmap(void);
+extern uint64 sys_setpriority(void);
+extern uint64 sys_setaffinity(void);
+extern uint64 sys_setquantum(void);
+extern uint64 sys_nanosleep(void);
+extern uint64 sys_nanotime(void);
+extern uint64 sys_clone(void);
+extern uint64 sys_futex(void);
+extern uint64 sys_waitpid(void);
+extern uint64 sys_splice(void);
+extern uint64 sys_tee(void);
+extern uint64 sys_lockstat(void);
+extern uint64 sys_pread(void);
+extern uint64 sys_pwrite(void);
+extern uint64 sys_lseek(void);
+extern uint64 sys_readv(void);
+extern uint64 sys_writev(void);
+extern uint64 sys_io_enter(void);
+extern uint64 sys_fsync(void);
+extern uint64 sys_fdatasync(void);
+extern uint64 sys_logstat(void);
+extern uint64 sys_setcopymode(void);
 
 // An array mapping syscall numbers from syscall.h
 // to the function that handles the system call.
@@ -130,8 +152,30 @@ static uint64(*syscalls[])(void) = {
 [SYS_mkdir]   sys_mkdir,
 [SYS_close]   sys_close,
 [SYS_flush]   sys_flush,
-[SYS_commit_worker] sys_commit_worker,
 [SYS_ftruncate] sys_ftruncate,
+[SYS_mmap]    sys_mmap,
+[SYS_munmap]  sys_munmap,
+[SYS_setpriority] sys_setpriority,
+[SYS_setaffinity] sys_setaffinity,
+[SYS_setquantum] sys_setquantum,
+[SYS_nanosleep] sys_nanosleep,
+[SYS_nanotime] sys_nanotime,
+[SYS_clone]   sys_clone,
+[SYS_futex]   sys_futex,
+[SYS_waitpid] sys_waitpid,
+[SYS_splice]  sys_splice,
+[SYS_tee]     sys_tee,
+[SYS_lockstat] sys_lockstat,
+[SYS_pread]   sys_pread,
+[SYS_pwrite]  sys_pwrite,
+[SYS_lseek]   sys_lseek,
+[SYS_readv]   sys_readv,
+[SYS_writev]  sys_writev,
+[SYS_io_enter] sys_io_enter,
+[SYS_fsync]   sys_fsync,
+[SYS_fdatasync] sys_fdatasync,
+[SYS_logstat] sys_logstat,
+[SYS_setcopymode] sys_setcopymode,
 };
 
 void
@@ -21,5 +21,27 @@
 #define SYS_mkdir  20
 #define SYS_close  21
 #define SYS_flush  23
-#define SYS_commit_worker 24
 #define SYS_ftruncate 22
+#define SYS_mmap   25
+#define SYS_munmap 26
+#define SYS_setpriority 27
+#define SYS_setaffinity 28
+#define SYS_setquantum 29
+#define SYS_nanosleep 30
+#define SYS_nanotime 31
+#define SYS_clone  32
+#define SYS_futex  33
+#define SYS_waitpid 34
+#define SYS_splice 35
+#define SYS_tee    36
+#define SYS_lockstat 37
+#define SYS_pread  38
+#define SYS_pwrite 39
+#define SYS_lseek  40
+#define SYS_readv  41
+#define SYS_writev 42
+#define SYS_io_enter 43
+#define SYS_fsync  44
+#define SYS_fdatasync 45
+#define SYS_logstat 46
+#define SYS_setcopymode 47
@@ -15,10 +15,32 @@
 #include "sleeplock.h"
 #include "file.h"
 #include "fcntl.h"
+#include "uio.h"
+#include "ioring.h"
 #include "buf.h"
 
+// Return the open file of file descriptor fd, or 0.
+// The caller gets a reference of its own, which it must drop
+// with fileclose(), so that another thread closing fd cannot
+// free the file while the caller is using it.
+static struct file*
+fdget(int fd)
+{
+  struct file* f;
+  struct tgroup* tg = myproc()->tg;
+
+  if (fd < 0 || fd >= NOFILE)
+    return 0;
+  acquire(&tg->lock);
+  if ((f = tg->ofile[fd]) != 0)
+    filedup(f);
+  release(&tg->lock);
+  return f;
+}
+
 // Fetch the nth word-sized system call argument as a file descriptor
 // and return both the descriptor and the corresponding struct file.
+// The caller must fileclose() the file when done with it, as for fdget().
 static int
 argfd(int n, int* pfd, struct file** pf)
 {
@@ -26,7 +48,7 @@ argfd(int n, int* pfd, struct file** pf)
   struct file* f;
 
   argint(n, &fd);
-  if (fd < 0 || fd >= NOFILE || (f = myproc()->ofile[fd]) == 0)
+  if ((f = fdget(fd)) == 0)
     return -1;
   if (pfd)
     *pfd = fd;
@@ -41,14 +63,18 @@ static int
 fdalloc(struct file* f)
 {
   int fd;
-  struct proc* p = myproc();
+  struct tgroup* tg = myproc()->tg;
 
+  // other threads may be allocating descriptors too.
+  acquire(&tg->lock);
   for (fd = 0; fd < NOFILE; fd++) {
-    if (p->ofile[fd] == 0) {
-      p->ofile[fd] = f;
+    if (tg->ofile[fd] == 0) {
+      tg->ofile[fd] = f;
+      release(&tg->lock);
       return fd;
     }
   }
+  release(&tg->lock);
   return -1;
 }
 
@@ -60,9 +86,11 @@ sys_dup(void)
 
   if (argfd(0, 0, &f) < 0)
     return -1;
-  if ((fd = fdalloc(f)) < 0)
+  // the new descriptor takes over argfd()'s reference.
+  if ((fd = fdalloc(f)) < 0) {
+    fileclose(f);
     return -1;
-  filedup(f);
+  }
   return fd;
 }
 
@@ -70,21 +98,23 @@ uint64
 sys_read(void)
 {
   struct file* f;
-  int n;
+  int n, r;
   uint64 p;
 
   argaddr(1, &p);
   argint(2, &n);
   if (argfd(0, 0, &f) < 0)
     return -1;
-  return fileread(f, p, n);
+  r = fileread(f, p, n);
+  fileclose(f);
+  return r;
 }
 
 uint64
 sys_write(void)
 {
   struct file* f;
-  int n;
+  int n, r;
   uint64 p;
 
   argaddr(1, &p);
@@ -92,20 +122,172 @@ sys_write(void)
   if (argfd(0, 0, &f) < 0)
     return -1;
 
-  return filewrite(f, p, n);
+  r = filewrite(f, p, n);
+  fileclose(f);
+  return r;
+}
+
+// Copy in the n struct iovecs at user address uiov for
+// readv() or writev(), checking that their total length fits
+// in the int they return.
+static int
+argiov(uint64 uiov, int n, struct iovec* iov)
+{
+  uint64 tot;
+  int i;
+
+  if (n < 0 || n > IOV_MAX)
+    return -1;
+  if (copyin(myproc()->pagetable, (char*)iov, uiov, n * sizeof(struct iovec)) < 0)
+    return -1;
+  tot = 0;
+  for (i = 0; i < n; i++) {
+    if (iov[i].iov_len > 0x7fffffff)
+      return -1;
+    tot += iov[i].iov_len;
+  }
+  if (tot > 0x7fffffff)
+    return -1;
+  return 0;
+}
+
+uint64
+sys_readv(void)
+{
+  struct file* f;
+  struct iovec iov[IOV_MAX];
+  uint64 p;
+  int n, r;
+
+  argaddr(1, &p);
+  argint(2, &n);
+  if (argiov(p, n, iov) < 0 || argfd(0, 0, &f) < 0)
+    return -1;
+  r = filereadv(f, iov, n);
+  fileclose(f);
+  return r;
+}
+
+uint64
+sys_writev(void)
+{
+  struct file* f;
+  struct iovec iov[IOV_MAX];
+  uint64 p;
+  int n, r;
+
+  argaddr(1, &p);
+  argint(2, &n);
+  if (argiov(p, n, iov) < 0 || argfd(0, 0, &f) < 0)
+    return -1;
+  r = filewritev(f, iov, n);
+  fileclose(f);
+  return r;
+}
+
+uint64
+sys_pread(void)
+{
+  struct file* f;
+  int n, off, r;
+  uint64 p;
+
+  argaddr(1, &p);
+  argint(2, &n);
+  argint(3, &off);
+  if (off < 0 || argfd(0, 0, &f) < 0)
+    return -1;
+  r = filereadat(f, p, n, off);
+  fileclose(f);
+  return r;
+}
+
+uint64
+sys_pwrite(void)
+{
+  struct file* f;
+  int n, off, r;
+  uint64 p;
+
+  argaddr(1, &p);
+  argint(2, &n);
+  argint(3, &off);
+  if (off < 0 || argfd(0, 0, &f) < 0)
+    return -1;
+  r = filewriteat(f, p, n, off);
+  fileclose(f);
+  return r;
+}
+
+uint64
+sys_lseek(void)
+{
+  struct file* f;
+  int off, whence, r;
+
+  argint(1, &off);
+  argint(2, &whence);
+  if (argfd(0, 0, &f) < 0)
+    return -1;
+  r = fileseek(f, off, whence);
+  fileclose(f);
+  return r;
+}
+
+// Close file descriptor fd.
+static int
+fdclose(int fd)
+{
+  struct file* f;
+  struct tgroup* tg = myproc()->tg;
+
+  if (fd < 0 || fd >= NOFILE)
+    return -1;
+  // only one of several threads closing fd may succeed.
+  acquire(&tg->lock);
+  if ((f = tg->ofile[fd]) == 0) {
+    release(&tg->lock);
+    return -1;
+  }
+  tg->ofile[fd] = 0;
+  release(&tg->lock);
+  fileclose(f);
+  return 0;
 }
 
 uint64
 sys_close(void)
 {
   int fd;
+
+  argint(0, &fd);
+  return fdclose(fd);
+}
+
+uint64
+sys_fsync(void)
+{
   struct file* f;
+  int r;
 
-  if (argfd(0, &fd, &f) < 0)
+  if (argfd(0, 0, &f) < 0)
     return -1;
-  myproc()->ofile[fd] = 0;
+  r = filesync(f, 0);
   fileclose(f);
-  return 0;
+  return r;
+}
+
+uint64
+sys_fdatasync(void)
+{
+  struct file* f;
+  int r;
+
+  if (argfd(0, 0, &f) < 0)
+    return -1;
+  r = filesync(f, 1);
+  fileclose(f);
+  return r;
 }
 
 uint64
@@ -116,10 +298,12 @@ sys_flush(void)
 }
 
 uint64
-sys_commit_worker(void)
+sys_logstat(void)
 {
-  launch_commit_worker();
-  return 0;
+  uint64 addr;
+
+  argaddr(0, &addr);
+  return logstats(addr);
 }
 
 uint64
@@ -127,11 +311,14 @@ sys_fstat(void)
 {
   struct file* f;
   uint64 st; // user pointer to struct stat
+  int r;
 
   argaddr(1, &st);
   if (argfd(0, 0, &f) < 0)
     return -1;
-  return filestat(f, st);
+  r = filestat(f, st);
+  fileclose(f);
+  return r;
 }
 
 // Create the path new as a link to the same inode as old.
@@ -322,18 +509,13 @@ fail:
   return 0;
 }
 
-uint64
-sys_open(void)
+// Open path with mode omode; return the new file descriptor, or -1.
+static int
+fileopen(char* path, int omode)
 {
-  char path[MAXPATH];
-  int fd, omode;
+  int fd;
   struct file* f;
   struct inode* ip;
-  int n;
-
-  argint(1, &omode);
-  if ((n = argstr(0, path, MAXPATH)) < 0)
-    return -1;
 
   begin_op();
 
@@ -402,6 +584,18 @@ sys_open(void)
   return fd;
 }
 
+uint64
+sys_open(void)
+{
+  char path[MAXPATH];
+  int omode;
+
+  argint(1, &omode);
+  if (argstr(0, path, MAXPATH) < 0)
+    return -1;
+  return fileopen(path, omode);
+}
+
 uint64
 sys_mkdir(void)
 {
@@ -442,24 +636,28 @@ uint64
 sys_chdir(void)
 {
   char path[MAXPATH];
-  struct inode* ip;
-  struct proc* p = myproc();
+  struct inode* ip, * old;
+  struct tgroup* tg = myproc()->tg;
 
   begin_op();
   if (argstr(0, path, MAXPATH) < 0 || (ip = namei(path)) == 0) {
     end_op();
     return -1;
   }
-  ilock(ip);
+  ilockshared(ip);
   if (ip->type != T_DIR) {
-    iunlockput(ip);
+    iunlockshared(ip);
+    iput(ip);
     end_op();
     return -1;
   }
-  iunlock(ip);
-  iput(p->cwd);
+  iunlockshared(ip);
+  acquire(&tg->lock);
+  old = tg->cwd;
+  tg->cwd = ip;
+  release(&tg->lock);
+  iput(old);
   end_op();
-  p->cwd = ip;
   return 0;
 }
 
@@ -520,15 +718,15 @@ sys_pipe(void)
   fd0 = -1;
   if ((fd0 = fdalloc(rf)) < 0 || (fd1 = fdalloc(wf)) < 0) {
     if (fd0 >= 0)
-      p->ofile[fd0] = 0;
+      p->tg->ofile[fd0] = 0;
     fileclose(rf);
     fileclose(wf);
     return -1;
   }
   if (copyout(p->pagetable, fdarray, (char*)&fd0, sizeof(fd0)) < 0 ||
     copyout(p->pagetable, fdarray + sizeof(fd0), (char*)&fd1, sizeof(fd1)) < 0) {
-    p->ofile[fd0] = 0;
-    p->ofile[fd1] = 0;
+    p->tg->ofile[fd0] = 0;
+    p->tg->ofile[fd1] = 0;
     fileclose(rf);
     fileclose(wf);
     return -1;
@@ -539,7 +737,7 @@ sys_pipe(void)
 // Adding truncate system call
 uint64 sys_ftruncate(void) {
   struct file* f;
-  int length;
+  int length, r;
 
   // fetch the length of the file passed in argument
   argint(1, &length);
@@ -550,5 +748,159 @@ uint64 sys_ftruncate(void) {
   if (argfd(0, 0, &f) < 0)
     return -1;
 
-  return filetruncate(f, length);
+  r = filetruncate(f, length);
+  fileclose(f);
+  return r;
+}
+
+uint64
+sys_splice(void)
+{
+  struct file *in, *out;
+  int n, r;
+
+  argint(2, &n);
+  if (argfd(0, 0, &in) < 0)
+    return -1;
+  if (argfd(1, 0, &out) < 0) {
+    fileclose(in);
+    return -1;
+  }
+  r = filesplice(in, out, n, 0);
+  fileclose(in);
+  fileclose(out);
+  return r;
+}
+
+uint64
+sys_tee(void)
+{
+  struct file *in, *out;
+  int n, r;
+
+  argint(2, &n);
+  if (argfd(0, 0, &in) < 0)
+    return -1;
+  if (argfd(1, 0, &out) < 0) {
+    fileclose(in);
+    return -1;
+  }
+  r = filesplice(in, out, n, 1);
+  fileclose(in);
+  fileclose(out);
+  return r;
+}
+
+uint64
+sys_mmap(void)
+{
+  uint64 addr;
+  int len, prot, flags, off;
+  struct file *f = 0;
+  uint64 r;
+
+  argaddr(0, &addr);
+  argint(1, &len);
+  argint(2, &prot);
+  argint(3, &flags);
+  argint(5, &off);
+  if((flags & MAP_ANONYMOUS) == 0 && argfd(4, 0, &f) < 0)
+    return -1;
+  // the mapping keeps its own reference to the inode.
+  r = mmap(addr, len, prot, flags, f, off);
+  if(f)
+    fileclose(f);
+  return r;
+}
+
+uint64
+sys_munmap(void)
+{
+  uint64 addr;
+  int len;
+
+  argaddr(0, &addr);
+  argint(1, &len);
+  return munmap(addr, len);
+}
+
+// Run operation e of an io ring, and return what the
+// system call it stands for would have.
+static int
+ioop(struct iosqe* e)
+{
+  char path[MAXPATH];
+  struct file* f;
+  int r;
+
+  if (e->op == IO_NOP)
+    return 0;
+  if (e->op == IO_OPEN) {
+    if (fetchstr(e->addr, path, MAXPATH) < 0)
+      return -1;
+    return fileopen(path, e->flags);
+  }
+  if (e->op == IO_CLOSE)
+    return fdclose(e->fd);
+
+  if ((f = fdget(e->fd)) == 0)
+    return -1;
+  if (e->op == IO_READ)
+    r = e->off < 0 ? fileread(f, e->addr, e->len) : filereadat(f, e->addr, e->len, e->off);
+  else if (e->op == IO_WRITE)
+    r = e->off < 0 ? filewrite(f, e->addr, e->len) : filewriteat(f, e->addr, e->len, e->off);
+  else if (e->op == IO_FSYNC)
+    r = filesync(f, 0);
+  else if (e->op == IO_FDATASYNC)
+    r = filesync(f, 1);
+  else
+    r = -1;
+  fileclose(f);
+  return r;
+}
+
+// io_enter(ring, n): run up to n queued operations of the
+// io ring at user address ring, in order, posting their
+// results. Returns the number run, or -1 if the ring is bad.
+uint64
+sys_io_enter(void)
+{
+  uint64 addr;
+  int n;
+  uint idx[4], first; // idx is sqhead, sqtail, cqhead, cqtail
+  struct ioring* r;
+  struct iosqe e;
+  struct iocqe c;
+  struct proc* p = myproc();
+
+  argaddr(0, &addr);
+  argint(1, &n);
+  r = (struct ioring*)addr;
+  if (n < 0 || copyin(p->pagetable, (char*)idx, addr, sizeof(idx)) < 0)
+    return -1;
+  if (idx[1] - idx[0] > IORING_SIZE || idx[3] - idx[2] > IORING_SIZE)
+    return -1;
+
+  first = idx[0];
+  while (idx[0] - first < n && idx[0] != idx[1] && idx[3] - idx[2] < IORING_SIZE) {
+    if (killed(p))
+      break;
+    if (copyin(p->pagetable, (char*)&e, (uint64)&r->sq[idx[0] % IORING_SIZE], sizeof(e)) < 0)
+      break;
+    c.data = e.data;
+    c.res = ioop(&e);
+    c.pad = 0;
+    // the operation has run, so it is consumed even if
+    // its result cannot be posted.
+    idx[0]++;
+    if (copyout(p->pagetable, (uint64)&r->cq[idx[3] % IORING_SIZE], (char*)&c, sizeof(c)) < 0)
+      break;
+    idx[3]++;
+  }
+
+  // publish the new sqhead and cqtail; the process owns the others.
+  if (copyout(p->pagetable, (uint64)&r->sqhead, (char*)&idx[0], sizeof(uint)) < 0 ||
+      copyout(p->pagetable, (uint64)&r->cqtail, (char*)&idx[3], sizeof(uint)) < 0)
+    return -1;
+  return idx[0] - first;
 }
@@ -32,42 +32,102 @@ sys_wait(void)
 {
   uint64 p;
   argaddr(0, &p);
-  return wait(p);
+  return wait(-1, p);
 }
 
 uint64
-sys_sbrk(void)
+sys_waitpid(void)
+{
+  int pid;
+  uint64 p;
+
+  argint(0, &pid);
+  argaddr(1, &p);
+  return wait(pid, p);
+}
+
+uint64
+sys_clone(void)
+{
+  uint64 fn, arg, stack;
+
+  argaddr(0, &fn);
+  argaddr(1, &arg);
+  argaddr(2, &stack);
+  return clone(fn, arg, stack);
+}
+
+uint64
+sys_futex(void)
 {
   uint64 addr;
-  int n;
+  int op, val;
 
-  argint(0, &n);
-  addr = myproc()->sz;
-  if(growproc(n) < 0)
-    return -1;
-  return addr;
+  argaddr(0, &addr);
+  argint(1, &op);
+  argint(2, &val);
+  return futex(addr, op, val);
 }
 
 uint64
-sys_sleep(void)
+sys_sbrk(void)
 {
   int n;
-  uint ticks0;
 
   argint(0, &n);
+  return growproc(n);
+}
+
+// Sleep until r_time() reaches deadline. Nothing wakes
+// tickslock's channel, so only the deadline or a kill does.
+// Returns -1 if killed.
+static int
+sleeptill(uint64 deadline)
+{
   acquire(&tickslock);
-  ticks0 = ticks;
-  while(ticks - ticks0 < n){
+  while(r_time() < deadline){
     if(killed(myproc())){
       release(&tickslock);
       return -1;
     }
-    sleep(&ticks, &tickslock);
+    sleepuntil(&tickslock, &tickslock, deadline);
   }
   release(&tickslock);
   return 0;
 }
 
+uint64
+sys_sleep(void)
+{
+  int n;
+
+  argint(0, &n);
+  if(n < 0)
+    n = 0;
+  return sleeptill(r_time() + (uint64)n * TICKTIME);
+}
+
+uint64
+sys_nanosleep(void)
+{
+  uint64 ns, n, now;
+
+  argaddr(0, &ns);
+  n = ns / NSPERTIME + (ns % NSPERTIME != 0);
+  now = r_time();
+  // a deadline past the end of time is never reached.
+  if(n > ~0ULL - now)
+    return sleeptill(~0ULL);
+  return sleeptill(now + n);
+}
+
+// return nanoseconds since start.
+uint64
+sys_nanotime(void)
+{
+  return r_time() * NSPERTIME;
+}
+
 uint64
 sys_kill(void)
 {
@@ -77,15 +137,65 @@ sys_kill(void)
   return kill(pid);
 }
 
-// return how many clock tick interrupts have occurred
+// return how many clock ticks have passed
 // since start.
 uint64
 sys_uptime(void)
 {
-  uint xticks;
+  return r_time() / TICKTIME;
+}
 
-  acquire(&tickslock);
-  xticks = ticks;
-  release(&tickslock);
-  return xticks;
+// set the scheduling class and nice value of a process.
+uint64
+sys_setpriority(void)
+{
+  int pid, class, nice;
+
+  argint(0, &pid);
+  argint(1, &class);
+  argint(2, &nice);
+  return setpriority(pid, class, nice);
+}
+
+uint64
+sys_setaffinity(void)
+{
+  int pid, mask;
+
+  argint(0, &pid);
+  argint(1, &mask);
+  return setaffinity(pid, (uint)mask);
+}
+
+uint64
+sys_setquantum(void)
+{
+  int usec;
+
+  argint(0, &usec);
+  if(usec < 0)
+    return -1;
+  return setquantum(usec);
+}
+
+uint64
+sys_setcopymode(void)
+{
+  int mode;
+
+  argint(0, &mode);
+  return setcopymode(mode);
+}
+
+uint64
+sys_lockstat(void)
+{
+  uint64 addr;
+  int n;
+
+  argaddr(0, &addr);
+  argint(1, &n);
+  if(n < 0)
+    return -1;
+  return lockstats(addr, n);
 }
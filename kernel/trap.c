@@ -7,7 +7,6 @@
 #include "defs.h"
 
 struct spinlock tickslock;
-uint ticks;
 
 extern char trampoline[], uservec[], userret[];
 
@@ -36,8 +35,6 @@ trapinithart(void)
 void
 usertrap(void)
 {
-  int which_dev = 0;
-
   if((r_sstatus() & SSTATUS_SPP) != 0)
     panic("usertrap: not from user mode");
 
@@ -45,6 +42,9 @@ usertrap(void)
   // since we're now in the kernel.
   w_stvec((uint64)kernelvec);
 
+  // tell tgpause() this CPU has left user mode.
+  mycpu()->inuser = 0;
+
   struct proc *p = myproc();
   
   // save user program counter.
@@ -65,7 +65,20 @@ usertrap(void)
     intr_on();
 
     syscall();
-  } else if((which_dev = devintr()) != 0){
+  } else if(r_scause() == 12 || r_scause() == 13 || r_scause() == 15){
+    // page fault. vmfault() may sleep reading a file,
+    // so fetch scause and stval before interrupts.
+    uint64 scause = r_scause();
+    uint64 va = r_stval();
+
+    intr_on();
+
+    if(vmfault(p->pagetable, va, scause == 15) == 0){
+      printf("usertrap(): unexpected scause %p pid=%d\n", scause, p->pid);
+      printf("            sepc=%p stval=%p\n", p->trapframe->epc, va);
+      setkilled(p);
+    }
+  } else if(devintr() != 0){
     // ok
   } else {
     printf("usertrap(): unexpected scause %p pid=%d\n", r_scause(), p->pid);
@@ -76,8 +89,9 @@ usertrap(void)
   if(killed(p))
     exit(-1);
 
-  // give up the CPU if this is a timer interrupt.
-  if(which_dev == 2)
+  // give up the CPU if its time slice is over,
+  // or a SCHED_RT process is waiting for it.
+  if(needresched())
     yield();
 
   usertrapret();
@@ -90,11 +104,28 @@ void
 usertrapret(void)
 {
   struct proc *p = myproc();
+  struct tgroup *tg = p->tg;
 
   // we're about to switch the destination of traps from
   // kerneltrap() to usertrap(), so turn off interrupts until
   // we're back in user space, where usertrap() is correct.
-  intr_off();
+  // but first wait while tgpause() keeps this thread's
+  // group out of user mode. tgpause() sets tg->pause before
+  // it looks for CPUs in user mode, and we set inuser before
+  // we look at tg->pause, so one of us sees the other.
+  for(;;){
+    intr_off();
+    mycpu()->inuser = tg;
+    __sync_synchronize();
+    if(tg->pause == 0)
+      break;
+    mycpu()->inuser = 0;
+    intr_on();
+    acquire(&tg->lock);
+    while(tg->pause)
+      sleep(&tg->pause, &tg->lock);
+    release(&tg->lock);
+  }
 
   // send syscalls, interrupts, and exceptions to uservec in trampoline.S
   uint64 trampoline_uservec = TRAMPOLINE + (uservec - trampoline);
@@ -123,10 +154,10 @@ usertrapret(void)
   uint64 satp = MAKE_SATP(p->pagetable);
 
   // jump to userret in trampoline.S at the top of memory, which 
-  // switches to the user page table, restores user registers,
-  // and switches to user mode with sret.
+  // switches to the user page table, restores user registers
+  // from this thread's trapframe, and switches to user mode with sret.
   uint64 trampoline_userret = TRAMPOLINE + (userret - trampoline);
-  ((void (*)(uint64))trampoline_userret)(satp);
+  ((void (*)(uint64, uint64))trampoline_userret)(satp, THREADFRAME(p->tslot));
 }
 
 // interrupts and exceptions from kernel code go here via kernelvec,
@@ -134,7 +165,6 @@ usertrapret(void)
 void 
 kerneltrap()
 {
-  int which_dev = 0;
   uint64 sepc = r_sepc();
   uint64 sstatus = r_sstatus();
   uint64 scause = r_scause();
@@ -144,14 +174,15 @@ kerneltrap()
   if(intr_get() != 0)
     panic("kerneltrap: interrupts enabled");
 
-  if((which_dev = devintr()) == 0){
+  if(devintr() == 0){
     printf("scause %p\n", scause);
     printf("sepc=%p stval=%p\n", r_sepc(), r_stval());
     panic("kerneltrap");
   }
 
-  // give up the CPU if this is a timer interrupt.
-  if(which_dev == 2 && myproc() != 0 && myproc()->state == RUNNING)
+  // give up the CPU if its time slice is over,
+  // or a SCHED_RT process is waiting for it.
+  if(myproc() != 0 && myproc()->state == RUNNING && needresched())
     yield();
 
   // the yield() may have caused some traps to occur,
@@ -160,15 +191,6 @@ kerneltrap()
   w_sstatus(sstatus);
 }
 
-void
-clockintr()
-{
-  acquire(&tickslock);
-  ticks++;
-  wakeup(&ticks);
-  release(&tickslock);
-}
-
 // check if it's an external interrupt or software interrupt,
 // and handle it.
 // returns 2 if timer interrupt,
@@ -202,17 +224,23 @@ devintr()
 
     return 1;
   } else if(scause == 0x8000000000000001L){
-    // software interrupt from a machine-mode timer interrupt,
-    // forwarded by timervec in kernelvec.S.
+    // software interrupt from a machine-mode timer interrupt
+    // or IPI, forwarded by timervec in kernelvec.S.
 
-    if(cpuid() == 0){
-      clockintr();
-    }
-    
     // acknowledge the software interrupt by clearing
     // the SSIP bit in sip.
     w_sip(r_sip() & ~2);
 
+    // an IPI only had to interrupt the CPU, and maybe
+    // change when its timer should go off.
+    if(!clockticked()){
+      timerarm();
+      return 1;
+    }
+
+    timerexpire();
+    timerarm();
+
     return 2;
   } else {
     return 0;
@@ -0,0 +1,7 @@
+// One buffer of a readv() or writev().
+struct iovec {
+  void *iov_base;    // Start of the buffer
+  uint64 iov_len;    // Its length in bytes
+};
+
+#define IOV_MAX 16   // most buffers in one readv() or writev()
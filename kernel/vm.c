@@ -5,6 +5,8 @@
 #include "riscv.h"
 #include "defs.h"
 #include "fs.h"
+#include "spinlock.h"
+#include "proc.h"
 
 /*
  * the kernel's page table.
@@ -20,6 +22,7 @@ pagetable_t
 kvmmake(void)
 {
   pagetable_t kpgtbl;
+  uint64 a;
 
   kpgtbl = (pagetable_t) kalloc();
   memset(kpgtbl, 0, PGSIZE);
@@ -33,19 +36,25 @@ kvmmake(void)
   // PLIC
   kvmmap(kpgtbl, PLIC, PLIC, 0x400000, PTE_R | PTE_W);
 
+  // CLINT, for IPIs and settimer()
+  kvmmap(kpgtbl, CLINT, CLINT, 0x10000, PTE_R | PTE_W);
+
   // map kernel text executable and read-only.
   kvmmap(kpgtbl, KERNBASE, KERNBASE, (uint64)etext-KERNBASE, PTE_R | PTE_X);
 
-  // map kernel data and the physical RAM we'll make use of.
-  kvmmap(kpgtbl, (uint64)etext, (uint64)etext, PHYSTOP-(uint64)etext, PTE_R | PTE_W);
+  // map kernel data and the physical RAM we'll make use of,
+  // with megapages from the first 2MB boundary on.
+  a = MEGAROUNDUP((uint64)etext);
+  if(a > (uint64)etext)
+    kvmmap(kpgtbl, (uint64)etext, (uint64)etext, a-(uint64)etext, PTE_R | PTE_W);
+  for(; a < PHYSTOP; a += MEGAPGSIZE)
+    if(mapmega(kpgtbl, a, a, PTE_R | PTE_W) != 0)
+      panic("kvmmap");
 
   // map the trampoline for trap entry/exit to
   // the highest virtual address in the kernel.
   kvmmap(kpgtbl, TRAMPOLINE, (uint64)trampoline, PGSIZE, PTE_R | PTE_X);
 
-  // allocate and map a kernel stack for each process.
-  proc_mapstacks(kpgtbl);
-  
   return kpgtbl;
 }
 
@@ -72,7 +81,8 @@ kvminithart()
 
 // Return the address of the PTE in page table pagetable
 // that corresponds to virtual address va.  If alloc!=0,
-// create any required page-table pages.
+// create any required page-table pages. If va lies in a
+// megapage, return its level-1 PTE, which has PTE_MEGA set.
 //
 // The risc-v Sv39 scheme has three levels of page-table
 // pages. A page-table page contains 512 64-bit PTEs.
@@ -90,6 +100,8 @@ walk(pagetable_t pagetable, uint64 va, int alloc)
 
   for(int level = 2; level > 0; level--) {
     pte_t *pte = &pagetable[PX(level, va)];
+    if(*pte & PTE_MEGA)
+      return pte;
     if(*pte & PTE_V) {
       pagetable = (pagetable_t)PTE2PA(*pte);
     } else {
@@ -102,6 +114,16 @@ walk(pagetable_t pagetable, uint64 va, int alloc)
   return &pagetable[PX(0, va)];
 }
 
+// Physical address of the page holding va, given the leaf PTE
+// that walk() returned for va, which may map a megapage.
+static uint64
+leafpa(pte_t pte, uint64 va)
+{
+  if(pte & PTE_MEGA)
+    return PTE2PA(pte) + PGROUNDDOWN(va & (MEGAPGSIZE-1));
+  return PTE2PA(pte);
+}
+
 // Look up a virtual address, return the physical address,
 // or 0 if not mapped.
 // Can only be used to look up user pages.
@@ -121,10 +143,25 @@ walkaddr(pagetable_t pagetable, uint64 va)
     return 0;
   if((*pte & PTE_U) == 0)
     return 0;
-  pa = PTE2PA(*pte);
+  pa = leafpa(*pte, va);
   return pa;
 }
 
+// Map the kernel stack page pa at va in the running kernel
+// page table, leaving the guard page below va unmapped, so a
+// stack overflow faults instead of overwriting other memory.
+// Nothing else maps into the kernel page table after boot, so
+// va was never valid and no CPU can have it in its TLB.
+// The caller serializes calls. Returns 0, or -1 if out of memory.
+int
+kvmmapstack(uint64 va, uint64 pa)
+{
+  if(mappages(kernel_pagetable, va, PGSIZE, pa, PTE_R | PTE_W) != 0)
+    return -1;
+  sfence_vma();
+  return 0;
+}
+
 // add a mapping to the kernel page table.
 // only used when booting.
 // does not flush TLB or enable paging.
@@ -164,25 +201,97 @@ mappages(pagetable_t pagetable, uint64 va, uint64 size, uint64 pa, int perm)
   return 0;
 }
 
+// Map the megapage at physical address pa at va; both must be
+// 2MB-aligned. Returns 0 on success, -1 if a needed page-table
+// page couldn't be allocated.
+int
+mapmega(pagetable_t pagetable, uint64 va, uint64 pa, int perm)
+{
+  pte_t *pte;
+  pagetable_t l1;
+
+  if((va % MEGAPGSIZE) != 0 || (pa % MEGAPGSIZE) != 0)
+    panic("mapmega: not aligned");
+
+  pte = &pagetable[PX(2, va)];
+  if(*pte & PTE_V) {
+    l1 = (pagetable_t)PTE2PA(*pte);
+  } else {
+    if((l1 = (pagetable_t)kalloc()) == 0)
+      return -1;
+    memset(l1, 0, PGSIZE);
+    *pte = PA2PTE(l1) | PTE_V;
+  }
+  pte = &l1[PX(1, va)];
+  if(*pte & PTE_V)
+    panic("mapmega: remap");
+  *pte = PA2PTE(pa) | perm | PTE_MEGA | PTE_V;
+  return 0;
+}
+
+// Replace the megapage PTE *pte, which covers va, with a
+// page-table page of 4K mappings of the same memory, so that
+// part of it can be unmapped; its pages become ordinary pages.
+// If no page-table page can be allocated, reuse the megapage's
+// last page, provided it lies below end, where the caller's
+// unmapping stops.
+static void
+megasplit(pte_t *pte, uint64 va, uint64 end)
+{
+  uint64 pa = PTE2PA(*pte);
+  uint64 last = MEGAROUNDDOWN(va) + MEGAPGSIZE - PGSIZE;
+  int perm = PTE_FLAGS(*pte) & ~PTE_MEGA;
+  pagetable_t l0;
+  int i, n;
+
+  megabreak((void*)pa);
+  n = 512;
+  if((l0 = (pagetable_t)kalloc()) == 0){
+    if(last >= end)
+      panic("megasplit");
+    l0 = (pagetable_t)(pa + MEGAPGSIZE - PGSIZE);
+    n = 511;
+  }
+  memset(l0, 0, PGSIZE);
+  for(i = 0; i < n; i++)
+    l0[i] = PA2PTE(pa + i*PGSIZE) | perm;
+  *pte = PA2PTE(l0) | PTE_V;
+}
+
 // Remove npages of mappings starting from va. va must be
-// page-aligned. The mappings must exist.
+// page-aligned. Pages that were never touched since a lazy
+// sbrk() have no mapping and are skipped. A megapage that
+// is only partly in the range is split into 4K pages first.
 // Optionally free the physical memory.
 void
 uvmunmap(pagetable_t pagetable, uint64 va, uint64 npages, int do_free)
 {
-  uint64 a;
+  uint64 a, end;
   pte_t *pte;
 
   if((va % PGSIZE) != 0)
     panic("uvmunmap: not aligned");
 
-  for(a = va; a < va + npages*PGSIZE; a += PGSIZE){
+  end = va + npages*PGSIZE;
+  for(a = va; a < end; a += PGSIZE){
     if((pte = walk(pagetable, a, 0)) == 0)
-      panic("uvmunmap: walk");
+      continue;
     if((*pte & PTE_V) == 0)
-      panic("uvmunmap: not mapped");
+      continue;
     if(PTE_FLAGS(*pte) == PTE_V)
       panic("uvmunmap: not a leaf");
+    if(*pte & PTE_MEGA){
+      if((a % MEGAPGSIZE) == 0 && a + MEGAPGSIZE <= end){
+        if(do_free)
+          megafree((void*)PTE2PA(*pte));
+        *pte = 0;
+        a += MEGAPGSIZE - PGSIZE;
+        continue;
+      }
+      megasplit(pte, a, end);
+      if((pte = walk(pagetable, a, 0)) == 0 || (*pte & PTE_V) == 0)
+        continue;
+    }
     if(do_free){
       uint64 pa = PTE2PA(*pte);
       kfree((void*)pa);
@@ -191,6 +300,26 @@ uvmunmap(pagetable_t pagetable, uint64 va, uint64 npages, int do_free)
   }
 }
 
+// Unmap and free npages of user memory starting at va from a
+// page table that other threads may be copying through, holding
+// lk, their group's pglock, for a megapage's worth at a time.
+// See copyout().
+void
+uvmunmapshared(pagetable_t pagetable, uint64 va, uint64 npages, struct spinlock *lk)
+{
+  uint64 end, next;
+
+  end = va + npages*PGSIZE;
+  for(; va < end; va = next){
+    next = MEGAROUNDDOWN(va) + MEGAPGSIZE;
+    if(next > end)
+      next = end;
+    acquire(lk);
+    uvmunmap(pagetable, va, (next - va) / PGSIZE, 1);
+    release(lk);
+  }
+}
+
 // create an empty user page table.
 // returns 0 if out of memory.
 pagetable_t
@@ -299,24 +428,60 @@ uvmfree(pagetable_t pagetable, uint64 sz)
 // Given a parent process's page table, copy
 // its memory into a child's page table.
 // Copies both the page table and the
-// physical memory.
+// physical memory, except that read-only
+// pages (program text) are shared.
+// A megapage is copied into a megapage if
+// one is free, else into 4K pages.
 // returns 0 on success, -1 on failure.
 // frees any allocated pages on failure.
 int
 uvmcopy(pagetable_t old, pagetable_t new, uint64 sz)
 {
   pte_t *pte;
-  uint64 pa, i;
+  uint64 pa, i, j;
   uint flags;
   char *mem;
 
   for(i = 0; i < sz; i += PGSIZE){
     if((pte = walk(old, i, 0)) == 0)
-      panic("uvmcopy: pte should exist");
+      continue;   // lazily allocated, never touched
     if((*pte & PTE_V) == 0)
-      panic("uvmcopy: page not present");
+      continue;
     pa = PTE2PA(*pte);
     flags = PTE_FLAGS(*pte);
+    if(flags & PTE_MEGA){
+      flags &= ~PTE_MEGA;
+      if((mem = megaalloc()) != 0){
+        memmove(mem, (char*)pa, MEGAPGSIZE);
+        if(mapmega(new, i, (uint64)mem, flags) != 0){
+          megafree(mem);
+          goto err;
+        }
+      } else {
+        for(j = 0; j < MEGAPGSIZE; j += PGSIZE){
+          if((mem = kalloc()) == 0){
+            i += j;
+            goto err;
+          }
+          memmove(mem, (char*)pa + j, PGSIZE);
+          if(mappages(new, i + j, PGSIZE, (uint64)mem, flags) != 0){
+            kfree(mem);
+            i += j;
+            goto err;
+          }
+        }
+      }
+      i += MEGAPGSIZE - PGSIZE;
+      continue;
+    }
+    if((flags & PTE_W) == 0){
+      kdup((void*)pa);
+      if(mappages(new, i, PGSIZE, pa, flags) != 0){
+        kfree((void*)pa);
+        goto err;
+      }
+      continue;
+    }
     if((mem = kalloc()) == 0)
       goto err;
     memmove(mem, (char*)pa, PGSIZE);
@@ -332,6 +497,129 @@ uvmcopy(pagetable_t old, pagetable_t new, uint64 sz)
   return -1;
 }
 
+// Map a zeroed megapage over the 2MB block holding heap page va,
+// if the whole block lies below the break, has no pages mapped yet,
+// and holds no demand-paged region. Returns the physical address
+// of va's page, or 0. Caller must hold p->tg->lock.
+static uint64
+megafault(struct proc *p, uint64 va)
+{
+  uint64 base = MEGAROUNDDOWN(va);
+  pagetable_t pagetable = p->pagetable;
+  struct vma *v;
+  char *mem;
+
+  if(base + MEGAPGSIZE > p->tg->sz)
+    return 0;
+  for(v = p->tg->vma; v < p->tg->vma + NVMA; v++)
+    if(v->end != 0 && v->start < base + MEGAPGSIZE && base < v->end)
+      return 0;
+  if(pagetable[PX(2, base)] & PTE_V){
+    pagetable = (pagetable_t)PTE2PA(pagetable[PX(2, base)]);
+    if(pagetable[PX(1, base)] & PTE_V)
+      return 0;
+  }
+  if((mem = megaalloc()) == 0)
+    return 0;
+  memset(mem, 0, MEGAPGSIZE);
+  if(mapmega(p->pagetable, base, (uint64)mem, PTE_R|PTE_W|PTE_U) != 0){
+    megafree(mem);
+    return 0;
+  }
+  return (uint64)mem + PGROUNDDOWN(va - base);
+}
+
+// Map the page at va if the current process may use it but has
+// not touched it yet: a page of one of the program's demand-paged
+// segments or of an mmap() region (see vma.c), or a heap page that
+// sbrk() added lazily, which is zero-filled. If write is set, also
+// make a page of a writable MAP_SHARED region writable, which
+// marks it as modified.
+// Called from usertrap() on a page fault, and from
+// copyin()/copyout() when the kernel touches such a page on
+// the process's behalf; it may sleep reading the file.
+// Other threads of the process may fault at the same time,
+// so the process's regions and page table are only examined
+// and changed with its tg->lock held.
+// Returns the physical address of the page, or 0 if va is
+// not such an address or memory is exhausted.
+uint64
+vmfault(pagetable_t pagetable, uint64 va, int write)
+{
+  struct proc *p = myproc();
+  struct tgroup *tg;
+  struct vma *v, cv;
+  pte_t *pte;
+  uint64 pa;
+  char *mem;
+  int perm;
+
+  if(p == 0 || p->tg == 0 || pagetable != p->pagetable || va >= MAXVA)
+    return 0;
+  tg = p->tg;
+  va = PGROUNDDOWN(va);
+  pa = 0;
+
+  acquire(&tg->lock);
+ again:
+  v = vmalookup(tg->vma, va);
+  if(v != 0 && v->flags == 0 && va >= tg->sz)
+    goto out;   // segment cut short by sbrk()
+  if(v == 0 && va >= tg->sz)
+    goto out;
+  if((pte = walk(pagetable, va, 0)) != 0 && (*pte & PTE_V)){
+    if(!write || (*pte & PTE_U) == 0 || v == 0 || (v->perm & PTE_W) == 0)
+      goto out;   // e.g. the stack guard page, or program text
+    if((*pte & PTE_W) == 0){
+      *pte |= PTE_W;
+      sfence_vma();
+    }
+    pa = leafpa(*pte, va);
+    goto out;
+  }
+  if(v != 0){
+    // reading the file may sleep, so fill the page without
+    // the lock, then check that the region is unchanged and
+    // that no other thread mapped the page meanwhile.
+    cv = *v;
+    tg->faulting++;
+    release(&tg->lock);
+    pa = vmapage(&cv, va, write, &perm);
+    acquire(&tg->lock);
+    if(--tg->faulting == 0)
+      wakeup(&tg->faulting);
+    if(pa == 0)
+      goto out;
+    v = vmalookup(tg->vma, va);
+    if(v == 0 || v->ip != cv.ip || v->perm != cv.perm || v->flags != cv.flags ||
+       v->off + (va - v->start) != cv.off + (va - cv.start) ||
+       ((pte = walk(pagetable, va, 0)) != 0 && (*pte & PTE_V))){
+      kfree((void*)pa);
+      pa = 0;
+      goto again;
+    }
+    if(mappages(pagetable, va, PGSIZE, pa, perm) != 0){
+      kfree((void*)pa);
+      pa = 0;
+    }
+    goto out;
+  }
+  if((pa = megafault(p, va)) != 0)
+    goto out;
+  if((mem = kalloc()) == 0)
+    goto out;
+  memset(mem, 0, PGSIZE);
+  if(mappages(pagetable, va, PGSIZE, (uint64)mem, PTE_R|PTE_W|PTE_U) != 0){
+    kfree(mem);
+    goto out;
+  }
+  pa = (uint64)mem;
+
+ out:
+  release(&tg->lock);
+  return pa;
+}
+
 // mark a PTE invalid for user access.
 // used by exec for the user stack guard page.
 void
@@ -345,6 +633,106 @@ uvmclear(pagetable_t pagetable, uint64 va)
   *pte &= ~PTE_U;
 }
 
+// If set, user copies move a byte at a time and walk the whole
+// page table for every page, as they did before word copies and
+// struct xlate, so that copybench can compare the two on one
+// kernel. Set with setcopymode().
+static int copyslow;
+
+// Set copyslow to mode, unless mode is negative, and return
+// its old value.
+int
+setcopymode(int mode)
+{
+  int old = copyslow;
+
+  if(mode >= 0)
+    copyslow = mode != 0;
+  return old;
+}
+
+// memmove() for a user copy.
+static void
+copymove(void *dst, const void *src, uint64 n)
+{
+  char *d = dst;
+  const char *s = src;
+
+  if(!copyslow){
+    memmove(dst, src, n);
+    return;
+  }
+  while(n-- > 0)
+    *d++ = *s++;
+}
+
+// A user copy's record of the last level-0 page-table page it
+// used, so that a copy spanning several pages walks the upper
+// levels of the page table once per 2MB instead of per page.
+struct xlate {
+  uint64 base;        // 2MB-aligned va mapped by l0
+  pagetable_t l0;     // or 0 if none yet
+};
+
+// Return the leaf PTE for user address va, like walk(),
+// looking in *x first and recording va's level-0 page there.
+static pte_t *
+xwalk(pagetable_t pagetable, struct xlate *x, uint64 va)
+{
+  pte_t *pte;
+
+  if(va >= MAXVA)
+    return 0;
+  if(x->l0 != 0 && MEGAROUNDDOWN(va) == x->base && !copyslow)
+    return &x->l0[PX(0, va)];
+  if((pte = walk(pagetable, va, 0)) != 0 && (*pte & PTE_MEGA) == 0){
+    x->base = MEGAROUNDDOWN(va);
+    x->l0 = (pagetable_t)PGROUNDDOWN((uint64)pte);
+  }
+  return pte;
+}
+
+// The lock a user copy through pagetable must hold while it
+// uses a page through the direct map, so that no other thread
+// of its group unmaps and frees the page meanwhile (munmap()
+// and sbrk() free pages holding it). 0 if the page table is
+// not the current group's, so no other thread can change it.
+static struct spinlock*
+copylock(pagetable_t pagetable)
+{
+  struct proc *p = myproc();
+
+  if(p == 0 || p->tg == 0 || p->pagetable != pagetable)
+    return 0;
+  return &p->tg->pglock;
+}
+
+// Return the physical address of user page va0, writable if
+// write, with lk (if any) held, faulting the page in first if
+// need be; vmfault() may sleep, so it is called without lk.
+// Returns 0, with lk not held, if there is no such page.
+static uint64
+copypage(pagetable_t pagetable, struct xlate *x, uint64 va0, int write, struct spinlock *lk)
+{
+  pte_t *pte;
+  int need, faulted;
+
+  need = PTE_V | PTE_U | (write ? PTE_W : 0);
+  for(faulted = 0; ; faulted = 1){
+    if(lk)
+      acquire(lk);
+    pte = xwalk(pagetable, x, va0);
+    if(pte != 0 && (*pte & need) == need)
+      return leafpa(*pte, va0);
+    if(lk)
+      release(lk);
+    // after a fault, a page that is still not writable may be
+    // program text shared with other processes; never write it.
+    if(faulted || vmfault(pagetable, va0, write) == 0)
+      return 0;
+  }
+}
+
 // Copy from kernel to user.
 // Copy len bytes from src to virtual address dstva in a given page table.
 // Return 0 on success, -1 on error.
@@ -352,16 +740,21 @@ int
 copyout(pagetable_t pagetable, uint64 dstva, char *src, uint64 len)
 {
   uint64 n, va0, pa0;
+  struct xlate x = { 0, 0 };
+  struct spinlock *lk = copylock(pagetable);
 
   while(len > 0){
     va0 = PGROUNDDOWN(dstva);
-    pa0 = walkaddr(pagetable, va0);
-    if(pa0 == 0)
+    if(va0 >= MAXVA)
+      return -1;
+    if((pa0 = copypage(pagetable, &x, va0, 1, lk)) == 0)
       return -1;
     n = PGSIZE - (dstva - va0);
     if(n > len)
       n = len;
-    memmove((void *)(pa0 + (dstva - va0)), src, n);
+    copymove((void *)(pa0 + (dstva - va0)), src, n);
+    if(lk)
+      release(lk);
 
     len -= n;
     src += n;
@@ -377,16 +770,21 @@ int
 copyin(pagetable_t pagetable, char *dst, uint64 srcva, uint64 len)
 {
   uint64 n, va0, pa0;
+  struct xlate x = { 0, 0 };
+  struct spinlock *lk = copylock(pagetable);
 
   while(len > 0){
     va0 = PGROUNDDOWN(srcva);
-    pa0 = walkaddr(pagetable, va0);
-    if(pa0 == 0)
+    if(va0 >= MAXVA)
+      return -1;
+    if((pa0 = copypage(pagetable, &x, va0, 0, lk)) == 0)
       return -1;
     n = PGSIZE - (srcva - va0);
     if(n > len)
       n = len;
-    memmove(dst, (void *)(pa0 + (srcva - va0)), n);
+    copymove(dst, (void *)(pa0 + (srcva - va0)), n);
+    if(lk)
+      release(lk);
 
     len -= n;
     dst += n;
@@ -404,11 +802,14 @@ copyinstr(pagetable_t pagetable, char *dst, uint64 srcva, uint64 max)
 {
   uint64 n, va0, pa0;
   int got_null = 0;
+  struct xlate x = { 0, 0 };
+  struct spinlock *lk = copylock(pagetable);
 
   while(got_null == 0 && max > 0){
     va0 = PGROUNDDOWN(srcva);
-    pa0 = walkaddr(pagetable, va0);
-    if(pa0 == 0)
+    if(va0 >= MAXVA)
+      return -1;
+    if((pa0 = copypage(pagetable, &x, va0, 0, lk)) == 0)
       return -1;
     n = PGSIZE - (srcva - va0);
     if(n > max)
@@ -428,6 +829,8 @@ copyinstr(pagetable_t pagetable, char *dst, uint64 srcva, uint64 max)
       p++;
       dst++;
     }
+    if(lk)
+      release(lk);
 
     srcva = va0 + PGSIZE;
   }
@@ -0,0 +1,476 @@
+//
+// Demand-paged regions of a process's user address space.
+//
+// exec() records each ELF segment of the program in tg->vma[]
+// instead of reading it in. vmfault() calls vmafill() the first
+// time the process touches a page of one of these regions.
+// Read-only pages that are entirely file contents (program text)
+// are mapped straight from the file page cache and so shared by
+// every process running the program; other pages get a private
+// copy.
+//
+// mmap() adds regions of the same kind, placed top-down below the
+// trapframes. Every MAP_SHARED mapping of a file maps the file's
+// page cache pages, so all of them see the same data, and write()
+// updates those pages. Such pages are mapped read-only until the
+// first write, which makes them writable; munmap(), exit() and
+// exec() write the writable ones back to the file through the log.
+// Until then read() takes a file's cached pages in preference to
+// its blocks, once the file has been mapped writable, so it sees
+// the stores as well.
+//
+// The regions are shared by the threads of a process, and
+// change only with tg->lock held.
+//
+
+#include "types.h"
+#include "riscv.h"
+#include "memlayout.h"
+#include "defs.h"
+#include "param.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "fs.h"
+#include "sleeplock.h"
+#include "file.h"
+#include "fcntl.h"
+
+// Return the region of vma[] containing va, or 0.
+struct vma*
+vmalookup(struct vma *vma, uint64 va)
+{
+  struct vma *v;
+
+  for(v = vma; v < vma + NVMA; v++)
+    if(v->end != 0 && va >= v->start && va < v->end)
+      return v;
+  return 0;
+}
+
+// Return an mmap() region of vma[] overlapping [start, end), or 0.
+struct vma*
+mmapoverlap(struct vma *vma, uint64 start, uint64 end)
+{
+  struct vma *v;
+
+  for(v = vma; v < vma + NVMA; v++)
+    if(v->end != 0 && v->flags != 0 && start < v->end && v->start < end)
+      return v;
+  return 0;
+}
+
+// Read in the page at page-aligned va of region v, and set
+// *permp to the permissions to map it with: writable only if
+// write is set in a MAP_SHARED file region. Returns the physical
+// address, or 0 if out of memory.
+uint64
+vmapage(struct vma *v, uint64 va, int write, int *permp)
+{
+  uint64 pa, fpa;
+  uint n, voff;
+  int perm;
+
+  voff = va - v->start;
+  n = 0;
+  if(voff < v->filesz)
+    n = v->filesz - voff < PGSIZE ? v->filesz - voff : PGSIZE;
+
+  // reading the file may sleep, which is not allowed
+  // with a spinlock held; see vmaprefault().
+  if(n > 0 && intr_get() == 0)
+    return 0;
+
+  perm = v->perm | PTE_U;
+  if(n == PGSIZE && (v->flags & MAP_SHARED)){
+    if((pa = pcget(v->ip, v->off + voff)) == 0)
+      return 0;
+    if(!write)
+      perm &= ~PTE_W;
+  } else if(n == PGSIZE && (v->perm & PTE_W) == 0){
+    if((pa = pcget(v->ip, v->off + voff)) == 0)
+      return 0;
+  } else {
+    if((pa = (uint64)kalloc()) == 0)
+      return 0;
+    memset((void*)pa, 0, PGSIZE);
+    if(n > 0){
+      if((fpa = pcget(v->ip, v->off + voff)) == 0){
+        kfree((void*)pa);
+        return 0;
+      }
+      memmove((void*)pa, (void*)fpa, n);
+      kfree((void*)fpa);
+    }
+  }
+  *permp = perm;
+  return pa;
+}
+
+// Read in the page at page-aligned va of region v and map it
+// in pagetable, as vmapage() says.
+// Returns the physical address, or 0 if out of memory.
+static uint64
+vmafill(pagetable_t pagetable, struct vma *v, uint64 va, int write)
+{
+  uint64 pa;
+  int perm;
+
+  if((pa = vmapage(v, va, write, &perm)) == 0)
+    return 0;
+  if(mappages(pagetable, va, PGSIZE, pa, perm) != 0){
+    kfree((void*)pa);
+    return 0;
+  }
+  return pa;
+}
+
+// Fault in the unmapped file-backed pages of [va, va+len)
+// ahead of a system call that will copy to or from them while
+// holding a spinlock (a pipe or the console), where vmfault()
+// cannot sleep to read the file, or while holding another
+// inode's lock, which could otherwise deadlock.
+void
+vmaprefault(uint64 va, uint64 len)
+{
+  struct proc *p = myproc();
+  struct tgroup *tg = p->tg;
+  uint64 a, lo, hi;
+  int i;
+
+  if(va + len < va)
+    return;
+  for(i = 0; i < NVMA; i++){
+    acquire(&tg->lock);
+    lo = tg->vma[i].start;
+    hi = lo + tg->vma[i].filesz;
+    if(tg->vma[i].end == 0)
+      hi = lo;
+    release(&tg->lock);
+    if(va >= hi || va + len <= lo)
+      continue;
+    if(va + len < hi)
+      hi = va + len;
+    for(a = PGROUNDDOWN(va > lo ? va : lo); a < hi; a += PGSIZE)
+      vmfault(p->pagetable, a, 0);
+  }
+}
+
+// Copy a process's regions for fork(), and the pages mapped in
+// its mmap() regions: MAP_SHARED and read-only pages are shared
+// with the child, writable MAP_PRIVATE pages copied. Touches every
+// page of a shared anonymous region first, so that parent and child
+// share all of it. Caller must hold the parent's tg->lock.
+// Returns 0 on success, -1 on failure.
+int
+vmacopy(pagetable_t old, pagetable_t new, struct vma *dst, struct vma *src)
+{
+  struct vma *v;
+  uint64 va, pa;
+  pte_t *pte;
+  char *mem;
+  int i;
+
+  for(v = src; v < src + NVMA; v++){
+    if(v->end == 0 || v->flags == 0)
+      continue;
+    for(va = v->start; va < v->end; va += PGSIZE){
+      if((pte = walk(old, va, 0)) == 0 || (*pte & PTE_V) == 0){
+        if(v->ip != 0 || (v->flags & MAP_SHARED) == 0)
+          continue;
+        if(vmafill(old, v, va, 1) == 0)
+          goto err;
+        pte = walk(old, va, 0);
+      }
+      pa = PTE2PA(*pte);
+      if((v->flags & MAP_SHARED) || (*pte & PTE_W) == 0){
+        kdup((void*)pa);
+      } else {
+        if((mem = kalloc()) == 0)
+          goto err;
+        memmove(mem, (char*)pa, PGSIZE);
+        pa = (uint64)mem;
+      }
+      if(mappages(new, va, PGSIZE, pa, PTE_FLAGS(*pte)) != 0){
+        kfree((void*)pa);
+        goto err;
+      }
+    }
+  }
+
+  for(i = 0; i < NVMA; i++){
+    dst[i] = src[i];
+    if(dst[i].end != 0 && dst[i].ip != 0)
+      idup(dst[i].ip);
+  }
+  return 0;
+
+ err:
+  for(v = src; v < src + NVMA; v++)
+    if(v->end != 0 && v->flags != 0)
+      uvmunmap(new, v->start, (v->end - v->start) / PGSIZE, 1);
+  return -1;
+}
+
+// Write the page at va of MAP_SHARED region v, at physical
+// address pa, back to the file, leaving out any part beyond
+// the end of the file. Each chunk is its own transaction, as
+// in filewrite().
+static void
+vmawriteback(struct vma *v, uint64 va, uint64 pa)
+{
+  int max = MAXOPBYTES;
+  uint off, i, n;
+
+  off = v->off + (va - v->start);
+  for(i = 0; i < PGSIZE; i += n){
+    n = PGSIZE - i < max ? PGSIZE - i : max;
+    begin_op();
+    ilock(v->ip);
+    if(off + i >= v->ip->size){
+      iunlock(v->ip);
+      end_op();
+      break;
+    }
+    if(off + i + n > v->ip->size)
+      n = v->ip->size - (off + i);
+    writei(v->ip, 0, pa + i, off + i, n);
+    iunlock(v->ip);
+    end_op();
+  }
+}
+
+// Unmap the pages of [start, end) in region v, writing
+// modified pages of a MAP_SHARED file region back first.
+static void
+vmaunmap(pagetable_t pagetable, struct vma *v, uint64 start, uint64 end)
+{
+  uint64 va;
+  pte_t *pte;
+
+  for(va = start; va < end; va += PGSIZE){
+    if((pte = walk(pagetable, va, 0)) == 0 || (*pte & PTE_V) == 0)
+      continue;
+    if(v->ip != 0 && (v->flags & MAP_SHARED) && (*pte & PTE_W))
+      vmawriteback(v, va, PTE2PA(*pte));
+    // other threads in the kernel may be copying to the page.
+    uvmunmapshared(pagetable, va, 1, &myproc()->tg->pglock);
+  }
+}
+
+// Write back and unmap all mmap() regions of vma[] in pagetable,
+// before exit() or exec() frees it. The regions themselves are
+// released by vmafree().
+void
+mmapclose(pagetable_t pagetable, struct vma *vma)
+{
+  struct vma *v;
+
+  for(v = vma; v < vma + NVMA; v++)
+    if(v->end != 0 && v->flags != 0)
+      vmaunmap(pagetable, v, v->start, v->end);
+}
+
+// Map len bytes of f starting at offset off, or zeroed memory if
+// f is 0, into the current process. The address is chosen top-down
+// below the trapframes unless addr is a free, page-aligned address.
+// Returns the address of the mapping, or -1.
+uint64
+mmap(uint64 addr, int len, int prot, int flags, struct file *f, int off)
+{
+  struct tgroup *tg = myproc()->tg;
+  struct vma *v, *o;
+  uint64 size, lo, top;
+  int perm;
+
+  if(len <= 0 || off < 0 || off % PGSIZE != 0)
+    return -1;
+  if((flags & (MAP_SHARED|MAP_PRIVATE)) == 0 ||
+     (flags & (MAP_SHARED|MAP_PRIVATE)) == (MAP_SHARED|MAP_PRIVATE))
+    return -1;
+  if((prot & (PROT_READ|PROT_WRITE|PROT_EXEC)) == 0)
+    return -1;
+  if(f != 0){
+    if(f->type != FD_INODE || !f->readable)
+      return -1;
+    if((flags & MAP_SHARED) && (prot & PROT_WRITE) && !f->writable)
+      return -1;
+  }
+
+  perm = 0;
+  if(prot & PROT_READ)
+    perm |= PTE_R;
+  if(prot & PROT_WRITE)
+    perm |= PTE_R|PTE_W;
+  if(prot & PROT_EXEC)
+    perm |= PTE_X;
+  size = PGROUNDUP((uint64)len);
+
+  acquire(&tg->lock);
+
+  // stay above the heap and the program's segments.
+  lo = PGROUNDUP(tg->sz);
+  for(o = tg->vma; o < tg->vma + NVMA; o++)
+    if(o->end != 0 && o->flags == 0 && o->end > lo)
+      lo = o->end;
+
+  for(v = tg->vma; v < tg->vma + NVMA; v++)
+    if(v->end == 0)
+      break;
+  if(v == tg->vma + NVMA)
+    goto bad;
+
+  if(addr != 0 && addr % PGSIZE == 0 && addr >= lo &&
+     addr + size <= USERTOP && addr + size > addr &&
+     mmapoverlap(tg->vma, addr, addr + size) == 0){
+    top = addr + size;
+  } else {
+    top = USERTOP;
+    while(top >= lo + size && (o = mmapoverlap(tg->vma, top - size, top)) != 0)
+      top = o->start;
+    if(top < lo + size || lo + size < lo)
+      goto bad;
+  }
+
+  v->start = top - size;
+  v->end = top;
+  v->perm = perm;
+  v->flags = flags & (MAP_SHARED|MAP_PRIVATE);
+  v->ip = f ? idup(f->ip) : 0;
+  if(f && (flags & MAP_SHARED) && (prot & PROT_WRITE))
+    v->ip->mapwrite = 1;
+  v->off = off;
+  v->filesz = f ? size : 0;
+  release(&tg->lock);
+  return v->start;
+
+ bad:
+  release(&tg->lock);
+  return -1;
+}
+
+// A part of a region that munmap() removed, to unmap
+// once the lock is released.
+struct unmapping {
+  struct vma v;          // the region as it was
+  uint64 start;          // the part to unmap
+  uint64 end;
+};
+
+// Remove the mappings of the current process in [addr, addr+len),
+// which may cover parts of several regions. Returns 0, or -1 if
+// the arguments are bad or a region would need splitting and
+// vma[] is full.
+int
+munmap(uint64 addr, int len)
+{
+  struct proc *p = myproc();
+  struct tgroup *tg = p->tg;
+  struct vma *v, *nv;
+  struct unmapping *gone, *g;
+  uint64 end;
+  int nsplit, nfree, ngone;
+
+  if(len <= 0 || addr % PGSIZE != 0)
+    return -1;
+  end = PGROUNDUP(addr + len);
+  if(end <= addr || end > USERTOP)
+    return -1;
+  if((gone = (struct unmapping*)kalloc()) == 0)
+    return -1;
+
+  // the other threads must not be using the pages while
+  // they are unmapped and freed.
+  tgpause(tg);
+  acquire(&tg->lock);
+
+  nsplit = nfree = 0;
+  for(v = tg->vma; v < tg->vma + NVMA; v++){
+    if(v->end == 0)
+      nfree++;
+    else if(v->flags != 0 && addr > v->start && end < v->end)
+      nsplit++;
+  }
+  if(nsplit > nfree){
+    release(&tg->lock);
+    tgresume(tg);
+    kfree((void*)gone);
+    return -1;
+  }
+
+  // Take the range out of the regions, so that vmfault()
+  // no longer maps pages in it. Each removed part keeps
+  // a reference to the file.
+  ngone = 0;
+  for(v = tg->vma; v < tg->vma + NVMA; v++){
+    if(v->end == 0 || v->flags == 0 || addr >= v->end || end <= v->start)
+      continue;
+    g = &gone[ngone++];
+    g->v = *v;
+    g->start = addr > v->start ? addr : v->start;
+    g->end = end < v->end ? end : v->end;
+    if(addr <= v->start && end >= v->end){
+      memset(v, 0, sizeof(*v));
+      continue;
+    }
+    if(v->ip)
+      idup(v->ip);
+    if(addr <= v->start){
+      if(v->ip){
+        v->off += end - v->start;
+        v->filesz -= end - v->start;
+      }
+      v->start = end;
+    } else if(end >= v->end){
+      if(v->ip)
+        v->filesz = addr - v->start;
+      v->end = addr;
+    } else {
+      // punch a hole, keeping the upper part in a new slot.
+      for(nv = tg->vma; nv->end != 0; nv++)
+        ;
+      *nv = *v;
+      nv->start = end;
+      if(nv->ip){
+        idup(nv->ip);
+        nv->off += end - v->start;
+        nv->filesz = v->end - end;
+        v->filesz = addr - v->start;
+      }
+      v->end = addr;
+    }
+  }
+  release(&tg->lock);
+
+  for(g = gone; g < gone + ngone; g++)
+    vmaunmap(p->pagetable, &g->v, g->start, g->end);
+
+  // a vmfault() may still be reading one of the files.
+  acquire(&tg->lock);
+  while(tg->faulting)
+    sleep(&tg->faulting, &tg->lock);
+  release(&tg->lock);
+
+  begin_op();
+  for(g = gone; g < gone + ngone; g++)
+    if(g->v.ip)
+      iput(g->v.ip);
+  end_op();
+
+  tgresume(tg);
+  kfree((void*)gone);
+  return 0;
+}
+
+// Release all regions in vma[].
+// Must be called inside a transaction since it calls iput().
+void
+vmafree(struct vma *vma)
+{
+  struct vma *v;
+
+  for(v = vma; v < vma + NVMA; v++){
+    if(v->end != 0 && v->ip != 0)
+      iput(v->ip);
+    memset(v, 0, sizeof(*v));
+  }
+}
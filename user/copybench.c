@@ -0,0 +1,124 @@
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/fcntl.h"
+#include "user/user.h"
+
+// Measure how fast the kernel copies data to and from user
+// space, in bytes per cycle: read() of a file held in the
+// buffer cache (copyout()) and write() into a pipe (copyin()).
+// Each is run twice: with setcopymode(1), which makes the kernel
+// copy as it did before word copies (a byte at a time, walking
+// the page table for every page), and then with the current copy.
+
+#define FILESZ (16*1024)   // small enough for the buffer cache
+#define ROUNDS 200
+
+char buf[FILESZ];
+
+static uint64
+rdcycle(void)
+{
+  uint64 x;
+  asm volatile("csrr %0, cycle" : "=r" (x));
+  return x;
+}
+
+// print bytes/cycles with three decimals.
+static void
+report(char *what, uint64 bytes, uint64 cycles)
+{
+  uint64 r = cycles ? bytes * 1000 / cycles : 0;
+
+  printf("%s: %l bytes in %l cycles, %l.%l%l%l bytes/cycle\n", what,
+         bytes, cycles, r / 1000, r / 100 % 10, r / 10 % 10, r % 10);
+}
+
+void
+readbench(void)
+{
+  char *f = "copybench.tmp";
+  uint64 t0, t1, total;
+  int fd, i, n;
+
+  fd = open(f, O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf("copybench: cannot create %s\n", f);
+    exit(1);
+  }
+  memset(buf, 'x', FILESZ);
+  if(write(fd, buf, FILESZ) != FILESZ){
+    printf("copybench: write failed\n");
+    exit(1);
+  }
+  close(fd);
+
+  total = 0;
+  t0 = rdcycle();
+  for(i = 0; i < ROUNDS; i++){
+    if((fd = open(f, O_RDONLY)) < 0){
+      printf("copybench: cannot open %s\n", f);
+      exit(1);
+    }
+    while((n = read(fd, buf, FILESZ)) > 0)
+      total += n;
+    close(fd);
+  }
+  t1 = rdcycle();
+  unlink(f);
+  report("read", total, t1 - t0);
+}
+
+void
+pipebench(void)
+{
+  uint64 t0, t1, total;
+  int fds[2], pid, i, n;
+
+  if(pipe(fds) < 0){
+    printf("copybench: pipe failed\n");
+    exit(1);
+  }
+  pid = fork();
+  if(pid < 0){
+    printf("copybench: fork failed\n");
+    exit(1);
+  }
+  if(pid == 0){
+    close(fds[1]);
+    while(read(fds[0], buf, FILESZ) > 0)
+      ;
+    exit(0);
+  }
+  close(fds[0]);
+
+  total = 0;
+  t0 = rdcycle();
+  for(i = 0; i < ROUNDS; i++){
+    if((n = write(fds[1], buf, FILESZ)) != FILESZ){
+      printf("copybench: pipe write failed\n");
+      exit(1);
+    }
+    total += n;
+  }
+  close(fds[1]);
+  wait(0);
+  t1 = rdcycle();
+  report("pipe", total, t1 - t0);
+}
+
+int
+main(int argc, char *argv[])
+{
+  int old;
+
+  old = setcopymode(1);
+  printf("byte copy, page walk per page:\n");
+  readbench();
+  pipebench();
+  setcopymode(0);
+  printf("word copy, page walk per 2MB:\n");
+  readbench();
+  pipebench();
+  setcopymode(old);
+  exit(0);
+}
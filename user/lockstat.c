@@ -0,0 +1,79 @@
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/param.h"
+#include "kernel/lockstat.h"
+#include "user/user.h"
+
+// print the locks that were waited for longest:
+//   lockstat [-n N] [cmd args...]
+// With a command, count only what happened while it ran.
+
+struct lockstat before[NLOCKCLASS], after[NLOCKCLASS];
+
+int
+main(int argc, char **argv)
+{
+  int i, j, n, nb, top, pid;
+  struct lockstat t, *b;
+
+  top = 10;
+  if(argc > 2 && strcmp(argv[1], "-n") == 0){
+    top = atoi(argv[2]);
+    argv += 2;
+    argc -= 2;
+  }
+  if(top <= 0){
+    fprintf(2, "usage: lockstat [-n N] [cmd args...]\n");
+    exit(1);
+  }
+
+  nb = 0;
+  if(argc > 1){
+    nb = lockstat(before, NLOCKCLASS);
+    if((pid = fork()) < 0){
+      fprintf(2, "lockstat: fork failed\n");
+      exit(1);
+    }
+    if(pid == 0){
+      exec(argv[1], argv+1);
+      fprintf(2, "lockstat: exec %s failed\n", argv[1]);
+      exit(1);
+    }
+    wait(0);
+  }
+  if((n = lockstat(after, NLOCKCLASS)) < 0){
+    fprintf(2, "lockstat: lockstat failed\n");
+    exit(1);
+  }
+
+  // Subtract the counts from before the command. Classes are
+  // only ever added, so they line up; the maxima cannot be
+  // subtracted and are those since boot.
+  for(i = 0; i < nb && i < n; i++){
+    b = &before[i];
+    after[i].nacquire -= b->nacquire;
+    after[i].ncontended -= b->ncontended;
+    after[i].nspin -= b->nspin;
+    after[i].waittime -= b->waittime;
+    after[i].holdtime -= b->holdtime;
+  }
+
+  // Sort by time spent waiting, most first.
+  for(i = 1; i < n; i++){
+    t = after[i];
+    for(j = i; j > 0 && after[j-1].waittime < t.waittime; j--)
+      after[j] = after[j-1];
+    after[j] = t;
+  }
+
+  printf("%s %s %s %s %s %s %s\n", "name", "acquire", "contended",
+         "wait", "maxwait", "hold", "maxhold");
+  for(i = 0; i < n && i < top; i++){
+    if(after[i].nacquire == 0)
+      continue;
+    printf("%s%s %l %l %l %l %l %l\n", after[i].name, after[i].sleep ? "(s)" : "",
+           after[i].nacquire, after[i].ncontended, after[i].waittime,
+           after[i].maxwait, after[i].holdtime, after[i].maxhold);
+  }
+  exit(0);
+}
@@ -0,0 +1,33 @@
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/sched.h"
+#include "user/user.h"
+
+// run a command with a nice value, or in the SCHED_RT class:
+//   nice n cmd args...
+//   nice rt cmd args...
+int
+main(int argc, char **argv)
+{
+  int class, n;
+
+  if(argc < 3){
+    fprintf(2, "usage: nice n|rt cmd args...\n");
+    exit(1);
+  }
+  class = SCHED_FAIR;
+  n = 0;
+  if(strcmp(argv[1], "rt") == 0)
+    class = SCHED_RT;
+  else if(argv[1][0] == '-')
+    n = -atoi(argv[1] + 1);
+  else
+    n = atoi(argv[1]);
+  if(setpriority(0, class, n) < 0){
+    fprintf(2, "nice: bad priority %s\n", argv[1]);
+    exit(1);
+  }
+  exec(argv[2], argv + 2);
+  fprintf(2, "nice: exec %s failed\n", argv[2]);
+  exit(1);
+}
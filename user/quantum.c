@@ -0,0 +1,29 @@
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "user/user.h"
+
+// print the scheduler's time slice, or set it:
+//   quantum [usec]
+int
+main(int argc, char **argv)
+{
+  int old;
+
+  if(argc > 2){
+    fprintf(2, "usage: quantum [usec]\n");
+    exit(1);
+  }
+  if(argc == 2 && atoi(argv[1]) <= 0){
+    fprintf(2, "quantum: bad time slice %s\n", argv[1]);
+    exit(1);
+  }
+  if((old = setquantum(argc == 2 ? atoi(argv[1]) : 0)) < 0){
+    fprintf(2, "quantum: %s usec is below the minimum\n", argv[1]);
+    exit(1);
+  }
+  if(argc == 2)
+    printf("quantum: %d -> %d usec\n", old, atoi(argv[1]));
+  else
+    printf("quantum: %d usec\n", old);
+  exit(0);
+}
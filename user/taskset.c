@@ -0,0 +1,49 @@
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "user/user.h"
+
+// run a command, or move a running process, on the CPUs
+// in a hexadecimal mask:
+//   taskset mask cmd args...
+//   taskset -p mask pid
+
+int
+hexmask(char *s)
+{
+  int m = 0;
+
+  if(s[0] == '0' && s[1] == 'x')
+    s += 2;
+  for(; *s; s++){
+    if(*s >= '0' && *s <= '9')
+      m = m*16 + *s - '0';
+    else if(*s >= 'a' && *s <= 'f')
+      m = m*16 + *s - 'a' + 10;
+    else
+      return 0;
+  }
+  return m;
+}
+
+int
+main(int argc, char **argv)
+{
+  if(argc == 4 && strcmp(argv[1], "-p") == 0){
+    if(setaffinity(atoi(argv[3]), hexmask(argv[2])) < 0){
+      fprintf(2, "taskset: cannot set affinity of %s\n", argv[3]);
+      exit(1);
+    }
+    exit(0);
+  }
+  if(argc < 3){
+    fprintf(2, "usage: taskset mask cmd args... | taskset -p mask pid\n");
+    exit(1);
+  }
+  if(setaffinity(0, hexmask(argv[1])) < 0){
+    fprintf(2, "taskset: bad mask %s\n", argv[1]);
+    exit(1);
+  }
+  exec(argv[2], argv + 2);
+  fprintf(2, "taskset: exec %s failed\n", argv[2]);
+  exit(1);
+}
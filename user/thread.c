@@ -0,0 +1,117 @@
+// User threads, made with clone(), and mutexes on futex().
+//
+// A thread runs on a stack from malloc(), which thread_join()
+// frees. malloc() itself is not thread-safe, so threads that
+// allocate memory must hold a mutex around malloc() and free().
+
+#include "kernel/types.h"
+#include "kernel/param.h"
+#include "kernel/futex.h"
+#include "user/user.h"
+
+#define TSTACK 4096   // bytes of stack per thread
+
+// What a new thread runs, at the top of its stack.
+struct tstart {
+  void (*fn)(void*);
+  void *arg;
+};
+
+static struct mutex tlock;
+static struct {
+  int tid;
+  char *stack;
+} threads[NTHREAD];
+
+static void
+tstart(void *a)
+{
+  struct tstart *s = a;
+
+  s->fn(s->arg);
+  exit(0);
+}
+
+// Start a thread running fn(arg), sharing memory and
+// files with the caller. Returns its id, or -1.
+int
+thread_create(void (*fn)(void*), void *arg)
+{
+  struct tstart *s;
+  char *stack;
+  int i, tid;
+
+  mutex_lock(&tlock);
+  for(i = 0; i < NTHREAD; i++)
+    if(threads[i].stack == 0)
+      break;
+  if(i == NTHREAD || (stack = malloc(TSTACK)) == 0){
+    mutex_unlock(&tlock);
+    return -1;
+  }
+  s = (struct tstart*)(stack + TSTACK - sizeof(*s));
+  s->fn = fn;
+  s->arg = arg;
+  // riscv sp must be 16-byte aligned.
+  if((tid = clone(tstart, s, (void*)((uint64)s & ~15))) < 0){
+    free(stack);
+    mutex_unlock(&tlock);
+    return -1;
+  }
+  threads[i].tid = tid;
+  threads[i].stack = stack;
+  mutex_unlock(&tlock);
+  return tid;
+}
+
+// Wait for thread tid, made by the calling thread, to exit,
+// and free its stack. Returns its exit status, or -1.
+int
+thread_join(int tid)
+{
+  int i, status;
+
+  if(waitpid(tid, &status) < 0)
+    return -1;
+  mutex_lock(&tlock);
+  for(i = 0; i < NTHREAD; i++){
+    if(threads[i].stack != 0 && threads[i].tid == tid){
+      free(threads[i].stack);
+      threads[i].stack = 0;
+    }
+  }
+  mutex_unlock(&tlock);
+  return status;
+}
+
+void
+mutex_init(struct mutex *m)
+{
+  m->v = 0;
+}
+
+// m->v is 0 when m is unlocked, 1 when locked, and
+// 2 when locked and other threads may be waiting.
+void
+mutex_lock(struct mutex *m)
+{
+  int c;
+
+  if((c = __sync_val_compare_and_swap(&m->v, 0, 1)) == 0)
+    return;
+  if(c != 2)
+    c = __sync_lock_test_and_set(&m->v, 2);
+  while(c != 0){
+    futex(&m->v, FUTEX_WAIT, 2);
+    c = __sync_lock_test_and_set(&m->v, 2);
+  }
+}
+
+void
+mutex_unlock(struct mutex *m)
+{
+  if(__sync_fetch_and_sub(&m->v, 1) != 1){
+    __sync_lock_release(&m->v);
+    futex(&m->v, FUTEX_WAKE, 1);
+  }
+}
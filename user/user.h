@@ -1,5 +1,9 @@
 #include <stdarg.h>
 struct stat;
+struct lockstat;
+struct logstat;
+struct iovec;
+struct ioring;
 
 // system calls
 int fork(void);
@@ -24,8 +28,30 @@ char* sbrk(int);
 int sleep(int);
 int uptime(void);
 int flush(void);
-int commit_worker(void);
 int ftruncate(int, int);
+void* mmap(void*, int, int, int, int, int);
+int munmap(void*, int);
+int setpriority(int, int, int);
+int setaffinity(int, int);
+int setquantum(int);
+int nanosleep(uint64);
+uint64 nanotime(void);
+int clone(void(*)(void*), void*, void*);
+int futex(int*, int, int);
+int waitpid(int, int*);
+int splice(int, int, int);
+int tee(int, int, int);
+int lockstat(struct lockstat*, int);
+int pread(int, void*, int, int);
+int pwrite(int, const void*, int, int);
+int lseek(int, int, int);
+int readv(int, const struct iovec*, int);
+int writev(int, const struct iovec*, int);
+int io_enter(struct ioring*, int);
+int fsync(int);
+int fdatasync(int);
+int logstat(struct logstat*);
+int setcopymode(int);
 
 // ulib.c
 int stat(const char*, struct stat*);
@@ -44,3 +70,13 @@ void free(void*);
 int atoi(const char*);
 int memcmp(const void*, const void*, uint);
 void* memcpy(void*, const void*, uint);
+
+// thread.c
+struct mutex {
+  int v;
+};
+int thread_create(void (*)(void*), void*);
+int thread_join(int);
+void mutex_init(struct mutex*);
+void mutex_lock(struct mutex*);
+void mutex_unlock(struct mutex*);
@@ -4,6 +4,9 @@
 #include "user/user.h"
 #include "kernel/fs.h"
 #include "kernel/fcntl.h"
+#include "kernel/uio.h"
+#include "kernel/ioring.h"
+#include "kernel/logstat.h"
 #include "kernel/syscall.h"
 #include "kernel/memlayout.h"
 #include "kernel/riscv.h"
@@ -1959,7 +1962,7 @@ iref(char *s)
 void
 forktest(char *s)
 {
-  enum{ N = 1000 };
+  enum{ N = NPROC+1 };
   int n, pid;
 
   for(n=0; n<N; n++){
@@ -1976,7 +1979,7 @@ forktest(char *s)
   }
 
   if(n == N){
-    printf("%s: fork claimed to work 1000 times!\n", s);
+    printf("%s: fork claimed to work %d times!\n", s, N);
     exit(1);
   }
 
@@ -2571,6 +2574,660 @@ badarg(char *s)
   exit(0);
 }
 
+// mmap(): a MAP_SHARED store reaches the file, a MAP_PRIVATE
+// one does not, and a shared anonymous mapping is shared with
+// a forked child.
+void
+mmaptest(char *s)
+{
+  char *f = "mmapfile";
+  char *p, buf[8];
+  int fd, pid, xstatus;
+
+  unlink(f);
+  fd = open(f, O_CREATE|O_RDWR);
+  if(fd < 0 || write(fd, "abcdefgh", 8) != 8){
+    printf("%s: create %s failed\n", s, f);
+    exit(1);
+  }
+
+  p = mmap(0, 8, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+  if(p == MAP_FAILED || p[0] != 'a' || p[7] != 'h'){
+    printf("%s: private mmap failed\n", s);
+    exit(1);
+  }
+  p[0] = 'X';
+  munmap(p, 8);
+
+  p = mmap(0, 8, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  if(p == MAP_FAILED || p[0] != 'a'){
+    printf("%s: shared mmap failed\n", s);
+    exit(1);
+  }
+  p[1] = 'Y';
+  if(munmap(p, 8) != 0){
+    printf("%s: munmap failed\n", s);
+    exit(1);
+  }
+  close(fd);
+
+  fd = open(f, O_RDONLY);
+  if(read(fd, buf, 8) != 8 || buf[0] != 'a' || buf[1] != 'Y'){
+    printf("%s: mmap store not written back\n", s);
+    exit(1);
+  }
+  close(fd);
+  unlink(f);
+
+  p = mmap(0, 4096, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+  if(p == MAP_FAILED){
+    printf("%s: anonymous mmap failed\n", s);
+    exit(1);
+  }
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    p[100] = 'z';
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != 0 || p[100] != 'z'){
+    printf("%s: anonymous MAP_SHARED not shared\n", s);
+    exit(1);
+  }
+  munmap(p, 4096);
+}
+
+// MAP_SHARED mappings of more pages than the page cache holds
+// stay coherent: read() sees stores through the mappings before
+// they are written back, write() reaches every mapped page, a
+// second mapping sees the first one's stores, and the stores are
+// still there once the mappings are gone.
+void
+mmapmanytest(char *s)
+{
+  enum { NF = 4, PER = (NPCACHE + 8 + NF - 1) / NF };
+  char name[16], buf[4096];
+  char *p[NF], *q;
+  int fd[NF], i, j;
+
+  memset(buf, 0, sizeof(buf));
+  for(i = 0; i < NF; i++){
+    strcpy(name, "mmapmanyX");
+    name[8] = '0' + i;
+    unlink(name);
+    fd[i] = open(name, O_CREATE|O_RDWR);
+    if(fd[i] < 0){
+      printf("%s: create %s failed\n", s, name);
+      exit(1);
+    }
+    for(j = 0; j < PER; j++){
+      if(write(fd[i], buf, sizeof(buf)) != sizeof(buf)){
+        printf("%s: write %s failed\n", s, name);
+        exit(1);
+      }
+    }
+    p[i] = mmap(0, PER*4096, PROT_READ|PROT_WRITE, MAP_SHARED, fd[i], 0);
+    if(p[i] == MAP_FAILED){
+      printf("%s: mmap %s failed\n", s, name);
+      exit(1);
+    }
+  }
+
+  // touch every page, so more than NPCACHE pages are mapped at once.
+  for(i = 0; i < NF; i++)
+    for(j = 0; j < PER; j++)
+      p[i][j*4096] = 'a' + (i*PER + j) % 26;
+
+  for(i = 0; i < NF; i++){
+    for(j = 0; j < PER; j++){
+      if(pread(fd[i], buf, 1, j*4096) != 1 || buf[0] != 'a' + (i*PER + j) % 26){
+        printf("%s: store not seen by read, file %d page %d\n", s, i, j);
+        exit(1);
+      }
+      if(pwrite(fd[i], "w", 1, j*4096 + 1) != 1){
+        printf("%s: pwrite failed\n", s);
+        exit(1);
+      }
+      if(p[i][j*4096 + 1] != 'w'){
+        printf("%s: write not seen by mapping, file %d page %d\n", s, i, j);
+        exit(1);
+      }
+    }
+  }
+
+  q = mmap(0, PER*4096, PROT_READ, MAP_SHARED, fd[0], 0);
+  if(q == MAP_FAILED){
+    printf("%s: second mmap failed\n", s);
+    exit(1);
+  }
+  for(j = 0; j < PER; j++){
+    if(q[j*4096] != 'a' + j % 26){
+      printf("%s: mappings disagree at page %d\n", s, j);
+      exit(1);
+    }
+  }
+  munmap(q, PER*4096);
+
+  for(i = 0; i < NF; i++){
+    if(munmap(p[i], PER*4096) != 0){
+      printf("%s: munmap failed\n", s);
+      exit(1);
+    }
+    for(j = 0; j < PER; j++){
+      if(pread(fd[i], buf, 2, j*4096) != 2 ||
+         buf[0] != 'a' + (i*PER + j) % 26 || buf[1] != 'w'){
+        printf("%s: store lost, file %d page %d\n", s, i, j);
+        exit(1);
+      }
+    }
+    close(fd[i]);
+    strcpy(name, "mmapmanyX");
+    name[8] = '0' + i;
+    unlink(name);
+  }
+}
+
+// nanosleep() sleeps at least as long as asked, and a sleeper
+// wakes at its own deadline, not at a later one's.
+void
+nanosleeptest(char *s)
+{
+  uint64 t0, t1;
+  int shortpid, longpid, xstatus;
+
+  t0 = nanotime();
+  if(nanosleep(20000000) < 0){
+    printf("%s: nanosleep failed\n", s);
+    exit(1);
+  }
+  t1 = nanotime();
+  if(t1 - t0 < 20000000){
+    printf("%s: nanosleep woke after %d ns\n", s, (int)(t1 - t0));
+    exit(1);
+  }
+
+  // sleepers of 10ms and 300ms, started together: the short one
+  // must be back long before the long one's deadline.
+  t0 = nanotime();
+  shortpid = fork();
+  if(shortpid == 0){
+    nanosleep(10000000);
+    exit(0);
+  }
+  longpid = fork();
+  if(longpid == 0){
+    nanosleep(300000000);
+    exit(0);
+  }
+  if(shortpid < 0 || longpid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(waitpid(shortpid, &xstatus) != shortpid || xstatus != 0){
+    printf("%s: short sleeper failed\n", s);
+    exit(1);
+  }
+  t1 = nanotime();
+  if(t1 - t0 < 10000000 || t1 - t0 > 150000000){
+    printf("%s: 10ms sleeper woke after %d ns\n", s, (int)(t1 - t0));
+    exit(1);
+  }
+  if(waitpid(longpid, &xstatus) != longpid || xstatus != 0){
+    printf("%s: long sleeper failed\n", s);
+    exit(1);
+  }
+  if(nanotime() - t0 < 300000000){
+    printf("%s: 300ms sleeper woke early\n", s);
+    exit(1);
+  }
+}
+
+// setquantum() refuses a time slice below 1ms and keeps the old one.
+void
+quantumtest(char *s)
+{
+  int old;
+
+  old = setquantum(0);
+  if(old <= 0 || setquantum(1) != -1 || setquantum(999) != -1 || setquantum(0) != old){
+    printf("%s: setquantum accepted a tiny time slice\n", s);
+    exit(1);
+  }
+  if(setquantum(1000) != old || setquantum(old) != 1000){
+    printf("%s: setquantum of 1ms failed\n", s);
+    exit(1);
+  }
+}
+
+// threads sharing a counter, a file descriptor, and a mutex.
+struct mutex clonemu;
+int clonecount;
+int clonefd;
+
+void
+clonethread(void *arg)
+{
+  int i;
+
+  for(i = 0; i < 1000; i++){
+    mutex_lock(&clonemu);
+    clonecount++;
+    mutex_unlock(&clonemu);
+  }
+  if(write(clonefd, arg, 1) != 1)
+    exit(1);
+  exit(0);
+}
+
+void
+clonetest(char *s)
+{
+  enum { N = 4 };
+  int i, tid[N], fds[2];
+  char buf[N];
+
+  if(pipe(fds) < 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  clonefd = fds[1];
+  mutex_init(&clonemu);
+  clonecount = 0;
+  for(i = 0; i < N; i++){
+    if((tid[i] = thread_create(clonethread, "x")) < 0){
+      printf("%s: thread_create failed\n", s);
+      exit(1);
+    }
+  }
+  for(i = 0; i < N; i++){
+    if(thread_join(tid[i]) != 0){
+      printf("%s: thread %d failed\n", s, i);
+      exit(1);
+    }
+  }
+  if(clonecount != N*1000){
+    printf("%s: count %d, expected %d\n", s, clonecount, N*1000);
+    exit(1);
+  }
+  if(read(fds[0], buf, N) != N){
+    printf("%s: threads did not share fd\n", s);
+    exit(1);
+  }
+  close(fds[0]);
+  close(fds[1]);
+}
+
+// kill() takes down every thread of a process: a thread asleep
+// in read() must exit as well, so that the process's files get
+// closed.
+int killfds[2], killdone[2];
+
+void
+killthread(void *arg)
+{
+  char c;
+
+  write(killdone[1], "r", 1);
+  read(killfds[0], &c, 1);   // nothing is ever written
+  exit(0);
+}
+
+void
+killthreadstest(char *s)
+{
+  int pid, xstatus;
+  char c;
+
+  if(pipe(killfds) < 0 || pipe(killdone) < 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    close(killdone[0]);
+    if(thread_create(killthread, 0) < 0)
+      exit(1);
+    for(;;)
+      ;
+  }
+  close(killfds[0]);
+  close(killdone[1]);
+  if(read(killdone[0], &c, 1) != 1){
+    printf("%s: thread did not start\n", s);
+    exit(1);
+  }
+  sleep(1);
+  kill(pid);
+  wait(&xstatus);
+  // the write end stays open in the child's files until its
+  // last thread has exited.
+  if(read(killdone[0], &c, 1) != 0){
+    printf("%s: killed process's files still open\n", s);
+    exit(1);
+  }
+  close(killdone[0]);
+  close(killfds[1]);
+}
+
+// move a file through pipes with splice() and tee().
+void
+splicetest(char *s)
+{
+  enum { N = 5000 };
+  int i, fd, p1[2], p2[2];
+  static char data[N], got[N];
+
+  for(i = 0; i < N; i++)
+    data[i] = 'a' + i % 26;
+  unlink("splicein");
+  fd = open("splicein", O_CREATE|O_RDWR);
+  if(fd < 0 || write(fd, data, N) != N){
+    printf("%s: create failed\n", s);
+    exit(1);
+  }
+  close(fd);
+
+  if(pipe(p1) < 0 || pipe(p2) < 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  fd = open("splicein", O_RDONLY);
+  if(splice(fd, p1[1], N) != N || splice(fd, p1[1], N) != 0){
+    printf("%s: splice from file failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  if(tee(p1[0], p2[1], N) != N){
+    printf("%s: tee failed\n", s);
+    exit(1);
+  }
+  if(read(p2[0], got, N) != N || memcmp(got, data, N) != 0){
+    printf("%s: tee copied wrong data\n", s);
+    exit(1);
+  }
+
+  unlink("spliceout");
+  fd = open("spliceout", O_CREATE|O_RDWR);
+  if(splice(p1[0], fd, N) != N){
+    printf("%s: splice to file failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  fd = open("spliceout", O_RDONLY);
+  if(read(fd, got, N) != N || memcmp(got, data, N) != 0){
+    printf("%s: spliced wrong data\n", s);
+    exit(1);
+  }
+  close(fd);
+  close(p1[0]);
+  close(p1[1]);
+  close(p2[0]);
+  close(p2[1]);
+  unlink("splicein");
+  unlink("spliceout");
+}
+
+// pread() and pwrite() at an offset, in two processes sharing
+// the file, leave the shared offset alone; lseek() moves it.
+void
+preadtest(char *s)
+{
+  enum { N = 3000 };
+  int i, fd, pid, xstatus;
+  static char data[N];
+  char buf[10];
+
+  for(i = 0; i < N; i++)
+    data[i] = 'a' + i % 26;
+  unlink("preadfile");
+  fd = open("preadfile", O_CREATE|O_RDWR);
+  if(fd < 0 || write(fd, data, N) != N){
+    printf("%s: create failed\n", s);
+    exit(1);
+  }
+  if(lseek(fd, 10, SEEK_SET) != 10){
+    printf("%s: lseek failed\n", s);
+    exit(1);
+  }
+
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < 100; i++){
+    if(pread(fd, buf, 3, 1000 + i) != 3 || memcmp(buf, data + 1000 + i, 3) != 0){
+      printf("%s: pread read wrong data\n", s);
+      exit(1);
+    }
+  }
+  if(pid == 0)
+    exit(0);
+  wait(&xstatus);
+  if(xstatus != 0)
+    exit(xstatus);
+
+  if(pwrite(fd, "XYZ", 3, 2000) != 3 || pread(fd, buf, 3, 2000) != 3 ||
+     memcmp(buf, "XYZ", 3) != 0){
+    printf("%s: pwrite failed\n", s);
+    exit(1);
+  }
+  if(read(fd, buf, 2) != 2 || memcmp(buf, data + 10, 2) != 0){
+    printf("%s: offset moved\n", s);
+    exit(1);
+  }
+  if(lseek(fd, -2, SEEK_CUR) != 10 || lseek(fd, 0, SEEK_END) != N ||
+     lseek(fd, 1, SEEK_END) != -1 || lseek(fd, -1, SEEK_SET) != -1){
+    printf("%s: lseek moved wrongly\n", s);
+    exit(1);
+  }
+  if(pread(fd, buf, 3, N + 5) != 0){
+    printf("%s: pread past end\n", s);
+    exit(1);
+  }
+  close(fd);
+  unlink("preadfile");
+}
+
+// writev() and readv() gather and scatter, including buffers
+// bigger than one write transaction and empty ones.
+void
+iovtest(char *s)
+{
+  enum { N = 4*BSIZE };
+  int i, fd;
+  static char a[N], b[N], got[N+20];
+  char hdr[10], tail[10];
+  struct iovec iov[4];
+
+  for(i = 0; i < N; i++){
+    a[i] = 'a' + i % 26;
+    b[i] = 'A' + i % 26;
+  }
+  iov[0].iov_base = "header";
+  iov[0].iov_len = 6;
+  iov[1].iov_base = a;
+  iov[1].iov_len = N;
+  iov[2].iov_base = 0;
+  iov[2].iov_len = 0;
+  iov[3].iov_base = b;
+  iov[3].iov_len = N;
+  unlink("iovfile");
+  fd = open("iovfile", O_CREATE|O_RDWR);
+  if(fd < 0 || writev(fd, iov, 4) != 6 + 2*N){
+    printf("%s: writev failed\n", s);
+    exit(1);
+  }
+  close(fd);
+
+  fd = open("iovfile", O_RDONLY);
+  iov[0].iov_base = hdr;
+  iov[1].iov_base = got;
+  iov[3].iov_base = tail;
+  iov[3].iov_len = sizeof(tail);
+  if(readv(fd, iov, 4) != 6 + N + sizeof(tail) || memcmp(hdr, "header", 6) != 0 ||
+     memcmp(got, a, N) != 0 || memcmp(tail, b, sizeof(tail)) != 0){
+    printf("%s: readv read wrong data\n", s);
+    exit(1);
+  }
+  if(read(fd, got, N+20) != N - sizeof(tail) || memcmp(got, b + sizeof(tail), N - sizeof(tail)) != 0){
+    printf("%s: readv left the offset wrong\n", s);
+    exit(1);
+  }
+  iov[0].iov_len = 0x80000000;
+  if(readv(fd, iov, 1) != -1 || readv(fd, iov, IOV_MAX+1) != -1){
+    printf("%s: readv took bad arguments\n", s);
+    exit(1);
+  }
+  close(fd);
+  unlink("iovfile");
+}
+
+// fsync() and fdatasync() of written, reopened and clean
+// files return; pipes have nothing to sync.
+void
+fsynctest(char *s)
+{
+  struct logstat before, after;
+  int fd, fds[2];
+
+  unlink("fsyncfile");
+  fd = open("fsyncfile", O_CREATE|O_RDWR);
+  // the write joins a transaction no older than before.txid,
+  // so fsync() must have made that one durable.
+  if(fd < 0 || logstat(&before) != 0 || write(fd, "hello", 5) != 5 ||
+     fsync(fd) != 0 || logstat(&after) != 0){
+    printf("%s: fsync of written file failed\n", s);
+    exit(1);
+  }
+  if(after.durable < before.txid){
+    printf("%s: fsync returned before transaction %d was on disk\n", s, before.txid);
+    exit(1);
+  }
+  if(fdatasync(fd) != 0 || logstat(&before) != 0 || write(fd, "world", 5) != 5){
+    printf("%s: write failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  fd = open("fsyncfile", O_RDONLY);
+  if(fd < 0 || fdatasync(fd) != 0 || logstat(&after) != 0){
+    printf("%s: fdatasync of reopened file failed\n", s);
+    exit(1);
+  }
+  if(after.durable < before.txid){
+    printf("%s: fdatasync returned before transaction %d was on disk\n", s, before.txid);
+    exit(1);
+  }
+  if(fsync(fd) != 0 || fsync(fd) != 0){
+    printf("%s: fsync of reopened file failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  if(pipe(fds) < 0 || fsync(fds[0]) != -1){
+    printf("%s: fsync of pipe succeeded\n", s);
+    exit(1);
+  }
+  close(fds[0]);
+  close(fds[1]);
+  unlink("fsyncfile");
+}
+
+// queue one operation on an io ring.
+static void
+ioqueue(struct ioring *r, int op, int fd, void *addr, int len, int off, uint64 data)
+{
+  struct iosqe *e = &r->sq[r->sqtail % IORING_SIZE];
+
+  e->op = op;
+  e->fd = fd;
+  e->addr = (uint64)addr;
+  e->len = len;
+  e->flags = O_CREATE|O_RDWR;
+  e->off = off;
+  e->data = data;
+  r->sqtail++;
+}
+
+// a batch of writes, then reads, through one io_enter() each,
+// with the completion ring filling up on the way.
+void
+ioringtest(char *s)
+{
+  enum { N = 40, SZ = 100 };
+  static struct ioring r;
+  static char data[N][SZ], got[N][SZ];
+  int i, fd, n;
+  struct iocqe *c;
+
+  for(i = 0; i < N; i++)
+    memset(data[i], 'a' + i % 26, SZ);
+  unlink("ioringfile");
+  ioqueue(&r, IO_OPEN, 0, "ioringfile", 0, 0, 1);
+  if(io_enter(&r, 1) != 1 || r.cqtail != 1 || (fd = r.cq[0].res) < 0){
+    printf("%s: io_enter open failed\n", s);
+    exit(1);
+  }
+  r.cqhead = 1;
+
+  for(i = 0; i < IORING_SIZE; i++)
+    ioqueue(&r, IO_WRITE, fd, data[i], SZ, -1, i);
+  if(io_enter(&r, IORING_SIZE) != IORING_SIZE){
+    printf("%s: io_enter writes failed\n", s);
+    exit(1);
+  }
+  // the completions fill the ring, so nothing more runs
+  // until they are read.
+  for(; i < N; i++)
+    ioqueue(&r, IO_WRITE, fd, data[i], SZ, -1, i);
+  if(io_enter(&r, N) != 0){
+    printf("%s: io_enter ran past a full completion ring\n", s);
+    exit(1);
+  }
+  for(; r.cqhead != r.cqtail; r.cqhead++){
+    c = &r.cq[r.cqhead % IORING_SIZE];
+    if(c->res != SZ){
+      printf("%s: io_enter write %d returned %d\n", s, (int)c->data, c->res);
+      exit(1);
+    }
+  }
+  if(io_enter(&r, N) != N - IORING_SIZE){
+    printf("%s: io_enter writes failed\n", s);
+    exit(1);
+  }
+  r.cqhead = r.cqtail;
+
+  // read back at offsets, in reverse order, then close.
+  n = 0;
+  for(i = N-1; i >= 0; i--){
+    if(r.sqtail - r.sqhead == IORING_SIZE){
+      n += io_enter(&r, IORING_SIZE);
+      r.cqhead = r.cqtail;
+    }
+    ioqueue(&r, IO_READ, fd, got[i], SZ, i*SZ, i);
+  }
+  ioqueue(&r, IO_CLOSE, fd, 0, 0, 0, 0);
+  n += io_enter(&r, N);
+  if(n != N+1 || r.cq[(r.cqtail-1) % IORING_SIZE].res != 0){
+    printf("%s: io_enter reads failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < N; i++){
+    if(memcmp(got[i], data[i], SZ) != 0){
+      printf("%s: io_enter read wrong data\n", s);
+      exit(1);
+    }
+  }
+  unlink("ioringfile");
+}
+
 struct test {
   void (*f)(char *);
   char *s;
@@ -2635,6 +3292,17 @@ struct test {
   {sbrklast, "sbrklast"},
   {sbrk8000, "sbrk8000"},
   {badarg, "badarg" },
+  {mmaptest, "mmaptest" },
+  {mmapmanytest, "mmapmanytest" },
+  {nanosleeptest, "nanosleeptest" },
+  {quantumtest, "quantumtest" },
+  {clonetest, "clonetest" },
+  {killthreadstest, "killthreadstest" },
+  {splicetest, "splicetest" },
+  {preadtest, "preadtest" },
+  {iovtest, "iovtest" },
+  {ioringtest, "ioringtest" },
+  {fsynctest, "fsynctest" },
 
   { 0, 0},
 };
@@ -37,5 +37,27 @@ entry("sbrk");
 entry("sleep");
 entry("uptime");
 entry("flush");
-entry("commit_worker");
 entry("ftruncate");
+entry("mmap");
+entry("munmap");
+entry("setpriority");
+entry("setaffinity");
+entry("setquantum");
+entry("nanosleep");
+entry("nanotime");
+entry("clone");
+entry("futex");
+entry("waitpid");
+entry("splice");
+entry("tee");
+entry("lockstat");
+entry("pread");
+entry("pwrite");
+entry("lseek");
+entry("readv");
+entry("writev");
+entry("io_enter");
+entry("fsync");
+entry("fdatasync");
+entry("logstat");
+entry("setcopymode");